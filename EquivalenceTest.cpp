@@ -0,0 +1,759 @@
+// 评分路径的等价性检查。几个评分路径声称与 Forest::Score(Sample) 的结果完全相同（逐位相等），本程序逐一比较：
+//   - 批量评分（Forest::Score 的矩阵接口）：逐棵树和交错推进的内核，以及不同的树块/样本块划分；
+//   - 延迟创建与立即创建的子树：评分相同，BuildLazySubtrees() 之后节点也相同；
+//   - ParallelScorer 与 Forest::Score，使用1、2、4个线程（线程数可以多于CPU数）；
+//   - 并发采集与串行采集：特征的顺序和评分都相同；
+//   - FixedForest 与用同样的数据和种子训练的 Forest；
+//   - 稀疏（CSR）训练和评分与补0的稠密矩阵；
+//   - DeltaScorer 的增量评分与重新评分整个样本；
+//   - ScoreCache：分数相同，重复的行命中，森林改变或句柄发布新森林后旧的项不再命中。
+// 另外检查几个行为：DriftMonitor 在已知的分数偏移上的PSI，截断或损坏的文件 Load 失败且不改变森林，
+// 以及内存预算的规划（预算不足时 Create() 返回false）。
+// 数据由固定种子生成，包含一个类别特征，部分样本缺少特征。所有检查都通过时返回0。
+//
+// 用法: EquivalenceTest [--samples N] [--trees T] [--subsample S] [--seed X]
+
+#include "IsolationForest.h"
+#include "FixedForest.h"
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace IsolationForest;
+
+namespace
+{
+	const char* const FEATURE_NAMES[] = { "a", "b", "c", "cat" };
+	const size_t NUM_FEATURES = sizeof(FEATURE_NAMES) / sizeof(FEATURE_NAMES[0]);
+
+	// 按行存放的样本，以及每个值是否存在。
+	struct TestData
+	{
+		std::vector<std::string> featureNames;
+		std::vector<uint64_t> values;
+		std::vector<uint8_t> present;
+		size_t numSamples;
+	};
+
+	void MakeData(uint64_t seed, size_t numSamples, uint64_t range, TestData& data)
+	{
+		std::mt19937_64 random(seed);
+		data.featureNames.assign(FEATURE_NAMES, FEATURE_NAMES + NUM_FEATURES);
+		data.values.resize(numSamples * NUM_FEATURES);
+		data.present.resize(numSamples * NUM_FEATURES);
+		data.numSamples = numSamples;
+		for (size_t row = 0; row < numSamples; ++row)
+		{
+			uint64_t* values = data.values.data() + row * NUM_FEATURES;
+			values[0] = random() % range;
+			values[1] = values[0] / 2 + random() % (range / 4 + 1);
+			values[2] = random() % (range * 2);
+			values[3] = random() % 40;
+
+			// 每行最多缺少一个特征。
+			size_t missing = (size_t)(random() % (NUM_FEATURES * 3));
+			for (size_t feature = 0; feature < NUM_FEATURES; ++feature)
+			{
+				data.present[row * NUM_FEATURES + feature] = (feature != missing) ? 1 : 0;
+			}
+		}
+	}
+
+	// 只有全部特征都存在的行可以用矩阵接口评分，其余的行只用 Score(Sample) 评分。
+	double ScoreSample(const Forest& forest, const TestData& data, size_t row)
+	{
+		std::vector<Feature> features;
+		features.reserve(NUM_FEATURES);
+		Sample sample("test");
+		for (size_t feature = 0; feature < NUM_FEATURES; ++feature)
+		{
+			if (data.present[row * NUM_FEATURES + feature])
+			{
+				features.push_back(Feature(data.featureNames[feature], data.values[row * NUM_FEATURES + feature]));
+				sample.AddFeature(&features.back());
+			}
+		}
+		return forest.Score(sample);
+	}
+
+	void ScoreSamples(const Forest& forest, const TestData& data, std::vector<double>& scores)
+	{
+		scores.resize(data.numSamples);
+		for (size_t row = 0; row < data.numSamples; ++row)
+		{
+			scores[row] = ScoreSample(forest, data, row);
+		}
+	}
+
+	size_t CountMismatches(const std::vector<double>& expected, const std::vector<double>& actual)
+	{
+		size_t mismatches = (expected.size() != actual.size()) ? 1 : 0;
+		for (size_t i = 0; i < std::min(expected.size(), actual.size()); ++i)
+		{
+			mismatches += (expected[i] != actual[i]) ? 1 : 0;
+		}
+		return mismatches;
+	}
+
+	bool Report(const std::string& check, size_t mismatches, size_t total)
+	{
+		std::cout << (mismatches == 0 ? "ok    " : "FAIL  ") << check << ": " << mismatches << " of " << total << " differ." << std::endl;
+		return mismatches == 0;
+	}
+
+	void Train(Forest& forest, const TestData& data)
+	{
+		forest.SetCategorical("cat");
+		forest.AddSamples(data.featureNames, data.values.data(), data.numSamples);
+	}
+
+	// 批量评分的各个内核与划分都与 Score(Sample) 相同。矩阵接口没有缺失值，所以只比较完整的行，
+	// 另外用缺少一列的矩阵比较缺失特征的情况。
+	bool CheckBatch(Forest& forest, const TestData& data)
+	{
+		std::vector<double> expected;
+		ScoreSamples(forest, data, expected);
+
+		std::vector<double> expectedComplete;
+		std::vector<uint64_t> completeValues;
+		for (size_t row = 0; row < data.numSamples; ++row)
+		{
+			bool complete = true;
+			for (size_t feature = 0; feature < NUM_FEATURES; ++feature)
+			{
+				complete = complete && data.present[row * NUM_FEATURES + feature];
+			}
+			if (complete)
+			{
+				expectedComplete.push_back(expected[row]);
+				completeValues.insert(completeValues.end(), data.values.begin() + row * NUM_FEATURES, data.values.begin() + (row + 1) * NUM_FEATURES);
+			}
+		}
+		size_t numComplete = expectedComplete.size();
+
+		// 缺少"b"列的矩阵，与只有其余特征的样本比较。
+		TestData withoutB = data;
+		std::vector<std::string> namesWithoutB;
+		std::vector<uint64_t> valuesWithoutB;
+		for (size_t feature = 0; feature < NUM_FEATURES; ++feature)
+		{
+			if (data.featureNames[feature] != "b")
+			{
+				namesWithoutB.push_back(data.featureNames[feature]);
+			}
+		}
+		for (size_t row = 0; row < data.numSamples; ++row)
+		{
+			for (size_t feature = 0; feature < NUM_FEATURES; ++feature)
+			{
+				bool isB = data.featureNames[feature] == "b";
+				withoutB.present[row * NUM_FEATURES + feature] = isB ? 0 : 1;
+				if (!isB)
+				{
+					valuesWithoutB.push_back(data.values[row * NUM_FEATURES + feature]);
+				}
+			}
+		}
+		std::vector<double> expectedWithoutB;
+		ScoreSamples(forest, withoutB, expectedWithoutB);
+
+		const size_t interleaves[] = { 1, 2, 8 };
+		const size_t treeBlockBytes[] = { 0, 4096 };
+		const size_t samplesPerBlock[] = { 0, 7 };
+		bool ok = true;
+		for (size_t i = 0; i < sizeof(interleaves) / sizeof(interleaves[0]); ++i)
+		{
+			for (size_t j = 0; j < sizeof(treeBlockBytes) / sizeof(treeBlockBytes[0]); ++j)
+			{
+				for (size_t k = 0; k < sizeof(samplesPerBlock) / sizeof(samplesPerBlock[0]); ++k)
+				{
+					forest.SetInterleave(interleaves[i]);
+					forest.SetBatchSchedule(treeBlockBytes[j], samplesPerBlock[k]);
+
+					std::vector<double> scores(numComplete);
+					forest.Score(data.featureNames, completeValues.data(), numComplete, scores.data());
+					std::vector<double> scoresWithoutB(data.numSamples);
+					forest.Score(namesWithoutB, valuesWithoutB.data(), data.numSamples, scoresWithoutB.data());
+
+					std::string check = "batch interleave " + std::to_string(interleaves[i]) + ", tree block " + std::to_string(treeBlockBytes[j]) +
+						" bytes, sample block " + std::to_string(samplesPerBlock[k]);
+					ok = Report(check, CountMismatches(expectedComplete, scores), numComplete) && ok;
+					ok = Report(check + ", missing column", CountMismatches(expectedWithoutB, scoresWithoutB), data.numSamples) && ok;
+				}
+			}
+		}
+		forest.SetInterleave(8);
+		forest.SetBatchSchedule(0, 0);
+		return ok;
+	}
+
+	// 延迟创建的子树与立即创建的相同：评分相同，放回之后节点也相同（类别位图表的位置除外）。
+	bool CheckLazy(const TestData& data, uint32_t numTrees, uint32_t subSamplingSize, uint64_t seed, bool sharded)
+	{
+		Forest eager(numTrees, subSamplingSize);
+		Forest lazy(numTrees, subSamplingSize);
+		eager.SetLazySubtrees(3, false);
+		lazy.SetLazySubtrees(3, true);
+		Train(eager, data);
+		Train(lazy, data);
+		if (sharded)
+		{
+			eager.GrowShard(seed, 0, numTrees);
+			lazy.GrowShard(seed, 0, numTrees);
+		}
+		else
+		{
+			eager.SetRandomizer(new Randomizer(seed));
+			lazy.SetRandomizer(new Randomizer(seed));
+			eager.Create();
+			lazy.Create();
+		}
+
+		std::string mode = sharded ? "GrowShard" : "Create";
+		size_t pending = lazy.NumLazySubtrees();
+		std::vector<double> eagerScores;
+		std::vector<double> lazyScores;
+		ScoreSamples(eager, data, eagerScores);
+		ScoreSamples(lazy, data, lazyScores);
+		bool ok = Report("lazy vs eager (" + mode + "), " + std::to_string(pending) + " subtrees deferred", CountMismatches(eagerScores, lazyScores), data.numSamples);
+
+		lazy.BuildLazySubtrees();
+		const PackedNodeList& eagerNodes = eager.Nodes();
+		const PackedNodeList& lazyNodes = lazy.Nodes();
+		size_t nodeMismatches = (eagerNodes.size() != lazyNodes.size() || eager.TreeRoots() != lazy.TreeRoots()) ? 1 : 0;
+		for (size_t i = 0; nodeMismatches == 0 && i < eagerNodes.size(); ++i)
+		{
+			const PackedNode& a = eagerNodes[i];
+			const PackedNode& b = lazyNodes[i];
+			bool same = a.featureAndFlags == b.featureAndFlags && a.childOffset == b.childOffset && (a.HasCategoryTable() || a.splitValue == b.splitValue);
+			nodeMismatches += same ? 0 : 1;
+		}
+		ok = Report("lazy vs eager (" + mode + ") nodes after BuildLazySubtrees", nodeMismatches, eagerNodes.size()) && ok;
+
+		ScoreSamples(lazy, data, lazyScores);
+		return Report("lazy vs eager (" + mode + ") after BuildLazySubtrees", CountMismatches(eagerScores, lazyScores), data.numSamples) && ok;
+	}
+
+	// ParallelScorer 与 Forest::Score 相同，工作线程在两次评分之间进入等待后也相同。
+	bool CheckParallel(const Forest& forest, const TestData& data)
+	{
+		std::vector<double> expected;
+		ScoreSamples(forest, data, expected);
+
+		const size_t threadCounts[] = { 1, 2, 4 };
+		bool ok = true;
+		for (size_t i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); ++i)
+		{
+			ParallelScorer scorer(forest, threadCounts[i], false);
+			std::vector<double> scores(data.numSamples);
+			std::vector<Feature> features;
+			for (size_t row = 0; row < data.numSamples; ++row)
+			{
+				features.clear();
+				features.reserve(NUM_FEATURES);
+				Sample sample("test");
+				for (size_t feature = 0; feature < NUM_FEATURES; ++feature)
+				{
+					if (data.present[row * NUM_FEATURES + feature])
+					{
+						features.push_back(Feature(data.featureNames[feature], data.values[row * NUM_FEATURES + feature]));
+						sample.AddFeature(&features.back());
+					}
+				}
+				scores[row] = scorer.Score(sample);
+				if (row == data.numSamples / 2)
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				}
+			}
+			ok = Report("ParallelScorer with " + std::to_string(scorer.NumThreads()) + " threads", CountMismatches(expected, scores), data.numSamples) && ok;
+		}
+		return ok;
+	}
+
+	// 并发采集与按同样顺序串行采集相同：特征索引（FeatureNames() 的顺序）和评分都相同。
+	// 样本中的特征按名称的逆序排列，分几个线程先后加入，所以新特征的顺序既不是名称顺序也不是分片顺序。
+	bool CheckConcurrentIngestion(const TestData& data, const TestData& test, uint32_t numTrees, uint32_t subSamplingSize, uint64_t seed)
+	{
+		Forest serial(numTrees, subSamplingSize);
+		Forest concurrent(numTrees, subSamplingSize);
+		serial.SetRandomizer(new Randomizer(seed));
+		concurrent.SetRandomizer(new Randomizer(seed));
+
+		const size_t numThreads = 3;
+		for (size_t thread = 0; thread < numThreads; ++thread)
+		{
+			size_t first = data.numSamples * thread / numThreads;
+			size_t last = data.numSamples * (thread + 1) / numThreads;
+			std::thread ingest([&, first, last]()
+			{
+				std::vector<Feature> features;
+				for (size_t row = first; row < last; ++row)
+				{
+					features.clear();
+					features.reserve(NUM_FEATURES);
+					Sample sample("train");
+					for (size_t feature = NUM_FEATURES; feature-- > 0; )
+					{
+						if (data.present[row * NUM_FEATURES + feature])
+						{
+							features.push_back(Feature(data.featureNames[feature], data.values[row * NUM_FEATURES + feature]));
+							sample.AddFeature(&features.back());
+						}
+					}
+					serial.AddSample(sample);
+					concurrent.AddSampleConcurrent(sample);
+				}
+			});
+			ingest.join();
+		}
+		serial.Create();
+		concurrent.Create();
+
+		const std::vector<std::string>& serialNames = serial.FeatureNames();
+		const std::vector<std::string>& concurrentNames = concurrent.FeatureNames();
+		size_t nameMismatches = (serialNames.size() != concurrentNames.size()) ? 1 : 0;
+		for (size_t i = 0; nameMismatches == 0 && i < serialNames.size(); ++i)
+		{
+			nameMismatches += (serialNames[i] != concurrentNames[i]) ? 1 : 0;
+		}
+		bool ok = Report("concurrent vs serial ingestion feature order", nameMismatches, serialNames.size());
+
+		std::vector<double> serialScores;
+		std::vector<double> concurrentScores;
+		ScoreSamples(serial, test, serialScores);
+		ScoreSamples(concurrent, test, concurrentScores);
+		return Report("concurrent vs serial ingestion scores", CountMismatches(serialScores, concurrentScores), test.numSamples) && ok;
+	}
+
+	// FixedForest 与用同样的数据和种子训练的 Forest 评分相同。样本总是包含全部特征，所以只用数值特征a、b、c，
+	// 它们按名称的顺序就是列的顺序，两个森林随机选到的特征相同。
+	bool CheckFixedForest(const TestData& data, const TestData& test, uint32_t numTrees, uint32_t subSamplingSize, uint64_t seed)
+	{
+		const size_t NUM_COLUMNS = 3;
+		typedef FixedForest<NUM_COLUMNS> Fixed;
+
+		std::vector<std::string> names(data.featureNames.begin(), data.featureNames.begin() + NUM_COLUMNS);
+		std::vector<uint64_t> values;
+		std::vector<Fixed::Values> fixedValues(data.numSamples);
+		for (size_t row = 0; row < data.numSamples; ++row)
+		{
+			for (size_t column = 0; column < NUM_COLUMNS; ++column)
+			{
+				values.push_back(data.values[row * NUM_FEATURES + column]);
+				fixedValues[row][column] = data.values[row * NUM_FEATURES + column];
+			}
+		}
+
+		Forest forest(numTrees, subSamplingSize);
+		forest.SetRandomizer(new Randomizer(seed));
+		forest.AddSamples(names, values.data(), data.numSamples);
+		forest.Create();
+
+		Fixed fixed(numTrees, subSamplingSize);
+		fixed.SetRandomizer(new Randomizer(seed));
+		fixed.AddSamples(fixedValues.data(), fixedValues.size());
+		fixed.Create();
+
+		std::vector<uint64_t> testValues;
+		std::vector<Fixed::Values> fixedTestValues(test.numSamples);
+		for (size_t row = 0; row < test.numSamples; ++row)
+		{
+			for (size_t column = 0; column < NUM_COLUMNS; ++column)
+			{
+				testValues.push_back(test.values[row * NUM_FEATURES + column]);
+				fixedTestValues[row][column] = test.values[row * NUM_FEATURES + column];
+			}
+		}
+		std::vector<double> expected(test.numSamples);
+		std::vector<double> scores(test.numSamples);
+		forest.Score(names, testValues.data(), test.numSamples, expected.data());
+		fixed.Score(fixedTestValues.data(), fixedTestValues.size(), scores.data());
+
+		bool ok = Report("FixedForest vs Forest, " + std::to_string(fixed.NumTrees()) + " trees", CountMismatches(expected, scores) + (fixed.NumTrees() == forest.NumTrees() ? 0 : 1), test.numSamples);
+		return ok && fixed.NumTrees() > 0;
+	}
+
+	// 全部特征都存在的行，按行存放。
+	void CompleteRows(const TestData& data, std::vector<uint64_t>& values)
+	{
+		values.clear();
+		for (size_t row = 0; row < data.numSamples; ++row)
+		{
+			bool complete = true;
+			for (size_t feature = 0; feature < NUM_FEATURES; ++feature)
+			{
+				complete = complete && data.present[row * NUM_FEATURES + feature];
+			}
+			if (complete)
+			{
+				values.insert(values.end(), data.values.begin() + row * NUM_FEATURES, data.values.begin() + (row + 1) * NUM_FEATURES);
+			}
+		}
+	}
+
+	// 稀疏数据：每个值以1/3的概率不为0，稠密矩阵中为0的值在CSR中不列出。
+	void MakeSparseData(uint64_t seed, size_t numSamples, size_t numFeatures, std::vector<std::string>& names, std::vector<uint64_t>& dense,
+		std::vector<size_t>& rowOffsets, std::vector<SparseFeature>& features)
+	{
+		std::mt19937_64 random(seed);
+		names.clear();
+		for (size_t feature = 0; feature < numFeatures; ++feature)
+		{
+			names.push_back("s" + std::to_string(feature));
+		}
+		dense.assign(numSamples * numFeatures, 0);
+		rowOffsets.assign(1, 0);
+		features.clear();
+		for (size_t row = 0; row < numSamples; ++row)
+		{
+			for (size_t feature = 0; feature < numFeatures; ++feature)
+			{
+				if (random() % 3 == 0)
+				{
+					SparseFeature sparseFeature = { (uint32_t)feature, 1 + random() % 50 };
+					dense[row * numFeatures + feature] = sparseFeature.value;
+					features.push_back(sparseFeature);
+				}
+			}
+			rowOffsets.push_back(features.size());
+		}
+	}
+
+	// 用CSR训练和评分的森林与用补0的稠密矩阵训练和评分的森林相同，单个稀疏样本的评分也相同。
+	bool CheckSparse(size_t numSamples, uint32_t numTrees, uint32_t subSamplingSize, uint64_t seed)
+	{
+		const size_t NUM_SPARSE_FEATURES = 6;
+		std::vector<std::string> names;
+		std::vector<uint64_t> dense;
+		std::vector<size_t> rowOffsets;
+		std::vector<SparseFeature> features;
+		MakeSparseData(seed, numSamples, NUM_SPARSE_FEATURES, names, dense, rowOffsets, features);
+
+		Forest denseForest(numTrees, subSamplingSize);
+		denseForest.SetRandomizer(new Randomizer(seed));
+		denseForest.AddSamples(names, dense.data(), numSamples);
+		denseForest.Create();
+
+		Forest sparseForest(numTrees, subSamplingSize);
+		sparseForest.SetRandomizer(new Randomizer(seed));
+		for (size_t feature = 0; feature < NUM_SPARSE_FEATURES; ++feature)
+		{
+			sparseForest.RegisterFeature(names[feature]);
+		}
+		sparseForest.AddSamples(rowOffsets.data(), features.data(), numSamples);
+		sparseForest.Create();
+
+		MakeSparseData(seed + 1, numSamples, NUM_SPARSE_FEATURES, names, dense, rowOffsets, features);
+		std::vector<double> expected(numSamples);
+		std::vector<double> scores(numSamples);
+		std::vector<double> sampleScores(numSamples);
+		denseForest.Score(names, dense.data(), numSamples, expected.data());
+		sparseForest.Score(rowOffsets.data(), features.data(), numSamples, scores.data());
+		for (size_t row = 0; row < numSamples; ++row)
+		{
+			SparseSample sample(features.begin() + rowOffsets[row], features.begin() + rowOffsets[row + 1]);
+			sampleScores[row] = sparseForest.Score(sample);
+		}
+
+		bool ok = Report("sparse CSR vs dense", CountMismatches(expected, scores), numSamples);
+		return Report("sparse sample vs dense", CountMismatches(expected, sampleScores), numSamples) && ok;
+	}
+
+	// DeltaScorer 每次更新一个特征后的分数与对更新后的整个样本重新评分相同，包括原来缺失的特征变为存在。
+	bool CheckDelta(const Forest& forest, const TestData& data)
+	{
+		DeltaScorer scorer(forest);
+		TestData current = data;
+		current.numSamples = 1;
+
+		std::vector<Feature> features;
+		features.reserve(NUM_FEATURES);
+		Sample sample("test");
+		for (size_t feature = 0; feature < NUM_FEATURES; ++feature)
+		{
+			if (current.present[feature])
+			{
+				features.push_back(Feature(current.featureNames[feature], current.values[feature]));
+				sample.AddFeature(&features.back());
+			}
+		}
+		size_t mismatches = (scorer.Reset(sample) != forest.Score(sample)) ? 1 : 0;
+
+		for (size_t update = 0; update < data.numSamples; ++update)
+		{
+			size_t row = (update * 7 + 1) % data.numSamples;
+			size_t feature = update % NUM_FEATURES;
+			current.values[feature] = data.values[row * NUM_FEATURES + feature];
+			current.present[feature] = 1;
+			double score = scorer.Update(data.featureNames[feature], current.values[feature]);
+			mismatches += (score != ScoreSample(forest, current, 0)) ? 1 : 0;
+		}
+		return Report("DeltaScorer vs full rescoring", mismatches, data.numSamples + 1);
+	}
+
+	// ScoreCache 的分数与不使用缓存时相同；重复的行命中（被替换的项除外）；森林的树改变或句柄发布新的森林之后，
+	// 旧的项不再命中。
+	bool CheckScoreCache(const TestData& data, const TestData& test, uint32_t numTrees, uint32_t subSamplingSize, uint64_t seed)
+	{
+		std::shared_ptr<Forest> first(new Forest(numTrees, subSamplingSize));
+		std::shared_ptr<Forest> second(new Forest(numTrees, subSamplingSize));
+		first->SetRandomizer(new Randomizer(seed));
+		second->SetRandomizer(new Randomizer(seed + 1));
+		Train(*first, data);
+		Train(*second, data);
+		first->Create();
+		second->Create();
+
+		std::vector<uint64_t> values;
+		CompleteRows(test, values);
+		size_t numRows = values.size() / NUM_FEATURES;
+		std::vector<double> expected(numRows);
+		std::vector<double> scores(numRows);
+
+		ScoreCache cache(test.featureNames, 4 * numRows);
+		first->Score(test.featureNames, values.data(), numRows, expected.data());
+		cache.Score(*first, values.data(), numRows, scores.data());
+		ScoreCacheStats before = cache.Stats();
+		bool ok = Report("ScoreCache first pass", CountMismatches(expected, scores), numRows);
+
+		cache.Score(*first, values.data(), numRows, scores.data());
+		ScoreCacheStats after = cache.Stats();
+		size_t misses = (size_t)(after.misses - before.misses);
+		ok = Report("ScoreCache repeated rows", CountMismatches(expected, scores), numRows) && ok;
+		ok = Report("ScoreCache repeated rows missed (beyond " + std::to_string(before.evictions) + " evictions)", misses > before.evictions ? misses : 0, numRows) && ok;
+
+		// Grow 改变森林的 Generation()。
+		first->Grow(numTrees / 4 + 1);
+		first->Score(test.featureNames, values.data(), numRows, expected.data());
+		before = cache.Stats();
+		cache.Score(*first, values.data(), numRows, scores.data());
+		after = cache.Stats();
+		ok = Report("ScoreCache after Grow", CountMismatches(expected, scores), numRows) && ok;
+		ok = Report("ScoreCache stale hits after Grow", (size_t)(after.hits - before.hits), numRows) && ok;
+
+		ForestHandle handle(first);
+		cache.Score(handle, values.data(), numRows, scores.data());
+		ok = Report("ScoreCache through ForestHandle", CountMismatches(expected, scores), numRows) && ok;
+
+		handle.Publish(second);
+		second->Score(test.featureNames, values.data(), numRows, expected.data());
+		before = cache.Stats();
+		cache.Score(handle, values.data(), numRows, scores.data());
+		after = cache.Stats();
+		ok = Report("ScoreCache after Publish", CountMismatches(expected, scores), numRows) && ok;
+		return Report("ScoreCache stale hits after Publish", (size_t)(after.hits - before.hits), numRows) && ok;
+	}
+
+	// DriftMonitor 的PSI与按公式直接计算的值相同。参考分数均匀分布在10个区间，窗口先填入同样分布的分数（PSI为0，
+	// 不触发），再全部换成只落在前5个区间的分数（PSI已知，触发一次回调）。
+	bool CheckDrift()
+	{
+		const size_t NUM_BINS = 10;
+		const size_t WINDOW = 200;
+		const double THRESHOLD = 0.25;
+		std::vector<double> reference;
+		for (size_t i = 0; i < 1000; ++i)
+		{
+			reference.push_back((double)i);
+		}
+		DriftMonitor monitor(reference, NUM_BINS, WINDOW, THRESHOLD);
+		size_t callbacks = 0;
+		monitor.SetCallback([&callbacks](double) { ++callbacks; });
+
+		size_t violations = 0;
+		for (size_t i = 0; i < WINDOW; ++i)
+		{
+			monitor.Add((double)(i * 5));
+		}
+		violations += (fabs(monitor.Divergence()) > 1e-9 || monitor.Drifted() || callbacks != 0) ? 1 : 0;
+
+		// 每个区间平滑后的比例：(count + 0.5) / (total + 0.5 * NUM_BINS)。
+		for (size_t i = 0; i < 2 * WINDOW; ++i)
+		{
+			monitor.Add((double)((i % 5) * 100 + 50));
+		}
+		double referenceFraction = (100 + 0.5) / (1000 + 0.5 * NUM_BINS);
+		double shifted = (WINDOW / 5 + 0.5) / (WINDOW + 0.5 * NUM_BINS);
+		double empty = 0.5 / (WINDOW + 0.5 * NUM_BINS);
+		double expected = 5 * (shifted - referenceFraction) * log(shifted / referenceFraction) + 5 * (empty - referenceFraction) * log(empty / referenceFraction);
+		violations += (fabs(monitor.Divergence() - expected) > 1e-9) ? 1 : 0;
+		violations += (!monitor.Drifted() || callbacks != 1) ? 1 : 0;
+
+		monitor.Reset();
+		violations += (monitor.Divergence() != 0.0 || monitor.Drifted() || monitor.WindowFill() != 0) ? 1 : 0;
+		return Report("DriftMonitor PSI " + std::to_string(expected) + " on a known shift", violations, 4);
+	}
+
+	// 保存后读取的森林评分相同；截断或结构损坏的文件 Load 返回false，并且不改变森林。
+	// 文件格式：8字节标识，特征数（64位），每个特征的名称长度（32位）和名称，然后是树根、节点和类别位图表，
+	// 每个都是64位的个数加上元素。
+	bool CheckLoad(const Forest& forest, const TestData& test)
+	{
+		std::string path = "/tmp/EquivalenceTest." + std::to_string(getpid()) + ".forest";
+		Forest loaded;
+		bool saved = forest.Save(path);
+		bool ok = Report("Save/Load", (saved && loaded.Load(path)) ? 0 : 1, 1);
+
+		std::vector<double> expected;
+		std::vector<double> scores;
+		ScoreSamples(forest, test, expected);
+		ScoreSamples(loaded, test, scores);
+		ok = Report("Save/Load round trip", CountMismatches(expected, scores), test.numSamples) && ok;
+
+		std::ifstream in(path.c_str(), std::ios::binary);
+		std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		in.close();
+
+		std::vector<std::string> damaged;
+		const size_t NUM_TRUNCATIONS = 64;
+		for (size_t i = 0; i < NUM_TRUNCATIONS; ++i)
+		{
+			damaged.push_back(contents.substr(0, contents.size() * i / NUM_TRUNCATIONS));
+		}
+		damaged.push_back(contents.substr(0, contents.size() - 1));
+
+		size_t headerSize = 8 + sizeof(uint64_t);
+		for (size_t i = 0; i < forest.FeatureNames().size(); ++i)
+		{
+			headerSize += sizeof(uint32_t) + forest.FeatureNames()[i].size();
+		}
+		size_t nodesStart = headerSize + sizeof(uint64_t) + forest.TreeRoots().size() * sizeof(uint32_t) + sizeof(uint64_t);
+		const uint64_t hugeCount = (uint64_t)1 << 40;
+		const uint32_t badIndex = 0xFFFFFFFF;
+
+		std::string corrupted = contents;
+		corrupted[0] ^= 1;
+		damaged.push_back(corrupted);
+		corrupted = contents;
+		corrupted.replace(8, sizeof(hugeCount), (const char*)&hugeCount, sizeof(hugeCount));
+		damaged.push_back(corrupted);
+		corrupted = contents;
+		corrupted.replace(headerSize, sizeof(hugeCount), (const char*)&hugeCount, sizeof(hugeCount));
+		damaged.push_back(corrupted);
+		corrupted = contents;
+		corrupted.replace(headerSize + sizeof(uint64_t), sizeof(badIndex), (const char*)&badIndex, sizeof(badIndex));
+		damaged.push_back(corrupted);
+
+		// 节点的特征索引超出特征表，以及非叶子右子节点的偏移越出树的范围。
+		const PackedNodeList& nodes = forest.Nodes();
+		uint32_t badFeature = nodes[0].featureAndFlags | PackedNode::FEATURE_INDEX_MASK;
+		corrupted = contents;
+		corrupted.replace(nodesStart + offsetof(PackedNode, featureAndFlags), sizeof(badFeature), (const char*)&badFeature, sizeof(badFeature));
+		damaged.push_back(corrupted);
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			if (nodes[i].HasRight() && !nodes[i].RightIsLeaf() && !nodes[i].LeftIsLeaf() && !nodes[i].NearIsRight())
+			{
+				corrupted = contents;
+				corrupted.replace(nodesStart + i * sizeof(PackedNode) + offsetof(PackedNode, childOffset), sizeof(badIndex), (const char*)&badIndex, sizeof(badIndex));
+				damaged.push_back(corrupted);
+				break;
+			}
+		}
+
+		size_t accepted = 0;
+		for (size_t i = 0; i < damaged.size(); ++i)
+		{
+			std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+			out.write(damaged[i].data(), (std::streamsize)damaged[i].size());
+			out.close();
+			accepted += loaded.Load(path) ? 1 : 0;
+		}
+		unlink(path.c_str());
+		ok = Report("Load of truncated or corrupted files", accepted, damaged.size()) && ok;
+
+		ScoreSamples(loaded, test, scores);
+		return Report("failed Load keeps the forest", CountMismatches(expected, scores), test.numSamples) && ok;
+	}
+
+	// 内存预算：足够时创建全部的树；较紧时降低深度；创建了树时总内存不超过预算。连训练状态都放不下时不创建树，
+	// Create() 返回false并在报告中标明。
+	bool CheckBudget(const TestData& data, uint32_t numTrees, uint32_t subSamplingSize, uint64_t seed)
+	{
+		Forest unlimited(numTrees, subSamplingSize);
+		unlimited.SetRandomizer(new Randomizer(seed));
+		Train(unlimited, data);
+		size_t trainingBytes = unlimited.MemoryUsage().trainingBytes;
+		unlimited.Create();
+		size_t treeBytes = unlimited.MemoryUsage().treeBytes;
+
+		const size_t budgets[] = { 4 * (trainingBytes + treeBytes), trainingBytes + treeBytes / 2, trainingBytes / 2 };
+		size_t violations = 0;
+		for (size_t i = 0; i < sizeof(budgets) / sizeof(budgets[0]); ++i)
+		{
+			Forest forest(numTrees, subSamplingSize);
+			forest.SetRandomizer(new Randomizer(seed));
+			forest.SetMemoryBudget(budgets[i]);
+			Train(forest, data);
+			bool created = forest.Create();
+			const ForestBudgetReport& report = forest.BudgetReport();
+			violations += (created && (forest.MemoryUsage().Total() > budgets[i] || report.treeBytesUsed > report.treeBytesAllowed)) ? 1 : 0;
+			if (i == 0)
+			{
+				violations += (!created || report.overBudget || forest.NumTrees() != numTrees) ? 1 : 0;
+			}
+			else if (i == 1)
+			{
+				violations += (!created || report.overBudget || forest.NumTrees() == 0 || report.depthLimit >= subSamplingSize || report.buildBytes == 0) ? 1 : 0;
+			}
+			else
+			{
+				violations += (created || !report.overBudget || forest.NumTrees() != 0) ? 1 : 0;
+			}
+		}
+		return Report("memory budget planning", violations, 2 * (sizeof(budgets) / sizeof(budgets[0])));
+	}
+
+	uint32_t OptionValue(int argc, const char* argv[], const char* name, uint32_t defaultValue)
+	{
+		for (int i = 1; i + 1 < argc; i += 2)
+		{
+			if (strcmp(argv[i], name) == 0)
+			{
+				return (uint32_t)strtoul(argv[i + 1], NULL, 10);
+			}
+		}
+		return defaultValue;
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+	size_t numSamples = OptionValue(argc, argv, "--samples", 1000);
+	uint32_t numTrees = OptionValue(argc, argv, "--trees", 40);
+	uint32_t subSamplingSize = OptionValue(argc, argv, "--subsample", 10);
+	uint64_t seed = OptionValue(argc, argv, "--seed", 1);
+
+	TestData training;
+	TestData test;
+	MakeData(seed, numSamples, 500, training);
+	MakeData(seed + 1, numSamples, 700, test);
+
+	Forest forest(numTrees, subSamplingSize);
+	forest.SetRandomizer(new Randomizer(seed));
+	Train(forest, training);
+	forest.Create();
+
+	bool ok = CheckBatch(forest, test);
+	ok = CheckLazy(training, numTrees, subSamplingSize, seed, false) && ok;
+	ok = CheckLazy(training, numTrees, subSamplingSize, seed, true) && ok;
+	ok = CheckParallel(forest, test) && ok;
+	ok = CheckConcurrentIngestion(training, test, numTrees, subSamplingSize, seed) && ok;
+	ok = CheckFixedForest(training, test, numTrees, subSamplingSize, seed) && ok;
+	ok = CheckSparse(numSamples, numTrees, subSamplingSize, seed) && ok;
+	ok = CheckDelta(forest, test) && ok;
+	ok = CheckScoreCache(training, test, numTrees, subSamplingSize, seed) && ok;
+	ok = CheckDrift() && ok;
+	ok = CheckLoad(forest, test) && ok;
+	ok = CheckBudget(training, numTrees, subSamplingSize, seed) && ok;
+
+	std::cout << (ok ? "All checks passed." : "Some checks failed.") << std::endl;
+	return ok ? 0 : 1;
+}
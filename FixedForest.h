@@ -0,0 +1,228 @@
+#pragma once
+
+#include "IsolationForest.h"
+#include <array>
+#include <type_traits>
+
+namespace IsolationForest
+{
+	// 能表示N个特征索引的最窄整数类型。
+	template <size_t N>
+	struct FixedFeatureIndex
+	{
+		typedef typename std::conditional<(N <= 0x100), uint8_t,
+			typename std::conditional<(N <= 0x10000), uint16_t, uint32_t>::type>::type Type;
+	};
+
+	// 特征数量固定为N的孤立森林。样本是 std::array<ValueT, N>，总是包含全部特征，
+	// 所以评分时不需要按名称查找特征，也不需要处理缺失特征，编译器可以展开对特征的访问。
+	// 训练使用同样的算法（借助一个临时的Forest），评分结果与对同样数据训练的Forest一致。
+	// Create() 转换完节点后释放临时的Forest和训练数据，之后再训练需要重新加入样本，并且从头创建所有的树。
+	// Forest 不分裂只有一个特征的数据，所以N至少为2。
+	template <size_t N, typename ValueT = uint64_t>
+	class FixedForest
+	{
+	public:
+		static_assert(N >= 2, "FixedForest needs at least two features");
+		static_assert(std::is_integral<ValueT>::value && std::is_unsigned<ValueT>::value, "FixedForest values must be unsigned integers");
+
+		typedef std::array<ValueT, N> Values;
+		typedef typename FixedFeatureIndex<N>::Type FeatureIndexType;
+
+		FixedForest(uint32_t numTrees, uint32_t subSamplingSize) : m_numTrees(numTrees), m_subSamplingSize(subSamplingSize) {};
+		virtual ~FixedForest() {};
+
+		// 随机化器属于下一次训练，Create() 时与训练数据一起释放。
+		void SetRandomizer(Randomizer* newRandomizer) { TrainingForest().SetRandomizer(newRandomizer); };
+
+		void AddSample(const Values& sample) { AddSamples(&sample, 1); };
+		void AddSamples(const Values* samples, size_t numSamples);
+		void Create();
+
+		double Score(const Values& sample) const;
+		void Score(const Values* samples, size_t numSamples, double* scores) const;
+
+		size_t NumTrees() const { return m_treeRoots.size(); };
+		size_t NumNodes() const { return m_nodes.size(); };
+
+	private:
+		// 与PackedNode相同的布局规则，只是分裂值和特征索引使用更窄的类型。
+		struct Node
+		{
+			enum
+			{
+				FLAG_HAS_LEFT = 0x01,
+				FLAG_HAS_RIGHT = 0x02,
+				FLAG_LEFT_LEAF = 0x04,
+				FLAG_RIGHT_LEAF = 0x08,
+				FLAG_NEAR_RIGHT = 0x10
+			};
+
+			ValueT splitValue;
+			FeatureIndexType featureIndex;
+			uint8_t flags;
+			uint32_t childOffset;
+		};
+
+		uint32_t m_numTrees;
+		uint32_t m_subSamplingSize;
+		std::unique_ptr<Forest> m_forest; // 训练用的动态森林，只在 Create() 之前存在
+		std::vector<Node> m_nodes;
+		std::vector<uint32_t> m_treeRoots;
+
+		static std::vector<std::string> ColumnNames();
+		Forest& TrainingForest();
+		double ScoreTree(const Values& sample, uint32_t nodeIndex) const;
+
+		FixedForest(const FixedForest&);
+		FixedForest& operator=(const FixedForest&);
+	};
+
+	// 列名按补零的十进制编号命名，按名称排序与按编号排序一致。
+	template <size_t N, typename ValueT>
+	std::vector<std::string> FixedForest<N, ValueT>::ColumnNames()
+	{
+		std::vector<std::string> names;
+		for (size_t column = 0; column < N; ++column)
+		{
+			char name[16];
+			snprintf(name, sizeof(name), "%010u", (unsigned int)column);
+			names.push_back(name);
+		}
+		return names;
+	}
+
+	template <size_t N, typename ValueT>
+	Forest& FixedForest<N, ValueT>::TrainingForest()
+	{
+		if (!m_forest)
+		{
+			m_forest.reset(new Forest(m_numTrees, m_subSamplingSize));
+		}
+		return *m_forest;
+	}
+
+	template <size_t N, typename ValueT>
+	void FixedForest<N, ValueT>::AddSamples(const Values* samples, size_t numSamples)
+	{
+		const size_t rowsPerChunk = 4096;
+		static const std::vector<std::string> names = ColumnNames();
+
+		std::vector<uint64_t> values;
+		values.reserve(std::min(numSamples, rowsPerChunk) * N);
+		for (size_t first = 0; first < numSamples; first += rowsPerChunk)
+		{
+			size_t chunkRows = std::min(rowsPerChunk, numSamples - first);
+			values.clear();
+			for (size_t row = 0; row < chunkRows; ++row)
+			{
+				values.insert(values.end(), samples[first + row].begin(), samples[first + row].end());
+			}
+			TrainingForest().AddSamples(names, values.data(), chunkRows);
+		}
+	}
+
+	// 训练后把森林的节点转换成窄类型的节点，然后释放训练用的森林。样本总是包含全部特征，压缩后的叶子只需要标志。
+	template <size_t N, typename ValueT>
+	void FixedForest<N, ValueT>::Create()
+	{
+		std::unique_ptr<Forest> forest(std::move(m_forest));
+		if (!forest)
+		{
+			forest.reset(new Forest(m_numTrees, m_subSamplingSize));
+		}
+		forest->Create();
+
+		const std::vector<std::string>& featureNames = forest->FeatureNames();
+		std::vector<FeatureIndexType> columns(featureNames.size());
+		for (size_t i = 0; i < featureNames.size(); ++i)
+		{
+			columns[i] = (FeatureIndexType)strtoul(featureNames[i].c_str(), NULL, 10);
+		}
+
+		const PackedNodeList& packedNodes = forest->Nodes();
+		m_nodes.resize(packedNodes.size());
+		m_nodes.shrink_to_fit();
+		for (size_t i = 0; i < packedNodes.size(); ++i)
+		{
+			const PackedNode& packedNode = packedNodes[i];
+			Node& node = m_nodes[i];
+			node.splitValue = (ValueT)packedNode.splitValue;
+			node.featureIndex = columns[packedNode.FeatureIndex()];
+			node.flags = (packedNode.HasLeft() ? Node::FLAG_HAS_LEFT : 0) |
+				(packedNode.HasRight() ? Node::FLAG_HAS_RIGHT : 0) |
+				(packedNode.LeftIsLeaf() ? Node::FLAG_LEFT_LEAF : 0) |
+				(packedNode.RightIsLeaf() ? Node::FLAG_RIGHT_LEAF : 0) |
+				(packedNode.NearIsRight() ? Node::FLAG_NEAR_RIGHT : 0);
+			node.childOffset = packedNode.childOffset;
+		}
+		m_treeRoots = forest->TreeRoots();
+	}
+
+	template <size_t N, typename ValueT>
+	double FixedForest<N, ValueT>::ScoreTree(const Values& sample, uint32_t nodeIndex) const
+	{
+		double depth = (double)0.0;
+
+		const Node* nodes = m_nodes.data();
+		while (true)
+		{
+			const Node& currentNode = nodes[nodeIndex];
+			uint8_t flags = currentNode.flags;
+
+			++depth;
+			if (sample[currentNode.featureIndex] < currentNode.splitValue)
+			{
+				if (flags & Node::FLAG_LEFT_LEAF)
+				{
+					++depth;
+					break;
+				}
+				if (!(flags & Node::FLAG_HAS_LEFT))
+				{
+					break;
+				}
+				nodeIndex += (flags & Node::FLAG_NEAR_RIGHT) ? currentNode.childOffset : 1;
+			}
+			else
+			{
+				if (flags & Node::FLAG_RIGHT_LEAF)
+				{
+					++depth;
+					break;
+				}
+				if (!(flags & Node::FLAG_HAS_RIGHT))
+				{
+					break;
+				}
+				nodeIndex += (flags & (Node::FLAG_LEFT_LEAF | Node::FLAG_NEAR_RIGHT)) ? 1 : currentNode.childOffset;
+			}
+		}
+		return depth;
+	}
+
+	template <size_t N, typename ValueT>
+	double FixedForest<N, ValueT>::Score(const Values& sample) const
+	{
+		double score = (double)0.0;
+
+		if (m_treeRoots.size() > 0)
+		{
+			for (size_t tree = 0; tree < m_treeRoots.size(); ++tree)
+			{
+				score += ScoreTree(sample, m_treeRoots[tree]);
+			}
+			score /= (double)m_treeRoots.size();
+		}
+		return score;
+	}
+
+	template <size_t N, typename ValueT>
+	void FixedForest<N, ValueT>::Score(const Values* samples, size_t numSamples, double* scores) const
+	{
+		for (size_t i = 0; i < numSamples; ++i)
+		{
+			scores[i] = Score(samples[i]);
+		}
+	}
+}
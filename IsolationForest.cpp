@@ -1,290 +1,3506 @@
 #include "IsolationForest.h"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#define PREFETCH_NODE(address) _mm_prefetch((const char*)(address), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define PREFETCH_NODE(address) __builtin_prefetch(address)
+#else
+#define PREFETCH_NODE(address)
+#endif
+
+// ȴʱ͹ģͬһϵһ߳С
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#define SPIN_PAUSE() _mm_pause()
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define SPIN_PAUSE() __builtin_ia32_pause()
+#else
+#define SPIN_PAUSE()
+#endif
 
 namespace IsolationForest
 {
-	Node::Node() :
-		m_splitValue(0),
-		m_left(NULL),
-		m_right(NULL)
+	// һڲɼƬеֵֻ׷ӣϴȥغʱȥһΡ
+	struct IngestBuffer
+	{
+		IngestBuffer() : compactedSize(0), firstCall(0), firstColumn(0) {};
+
+		std::vector<uint64_t> values;
+		size_t compactedSize;
+		uint64_t firstCall; // һγֵĲɼ
+		size_t firstColumn; // ԼǴεеλ
+
+		void Add(uint64_t value)
+		{
+			values.push_back(value);
+			if (values.size() >= 4096 && values.size() >= 2 * compactedSize)
+			{
+				std::sort(values.begin(), values.end());
+				values.erase(std::unique(values.begin(), values.end()), values.end());
+				compactedSize = values.size();
+			}
+		}
+	};
+
+	// ɼķƬÿ̶̹߳ʹһƬᷢ
+	struct IngestShard
+	{
+		std::mutex mutex;
+		std::map<std::string, IngestBuffer> buffers;
+	};
+
+	// ʱʹõѵֵÿ˳ΨһֵԼʱ־
+	// ֮ SetCategorical() ӰѾʼӳٴʱһֱ浽ꡣ
+	struct ValueSnapshot
+	{
+		std::vector<std::string> names;
+		std::vector<std::vector<uint64_t> > values;
+		std::vector<uint32_t> indices; // ÿ
+		std::vector<uint8_t> categorical; // 
+	};
+
+	// ʱһǰֵϣֵһΡѺļϿܲ
+	// ʱгָгֵ
+	struct ValueRange
+	{
+		size_t begin;
+		size_t end;
+		bool listed; // ָгֵǿ
+	};
+
+	// һӳٴҪֵϰ¼Ϊе䣬гֵvaluesС
+	// Ľڵûѹڵλ0λͼԼıС
+	struct LazySubtree
+	{
+		std::shared_ptr<const ValueSnapshot> snapshot;
+		std::vector<ValueRange> ranges;
+		std::vector<uint64_t> values;
+		uint64_t seed;
+		uint64_t position;
+		uint32_t depth;
+		uint32_t depthLimit;
+		std::atomic<bool> built;
+		PackedNodeList nodes;
+		std::vector<uint64_t> categoryTable;
+	};
+
+	namespace
+	{
+		// ɭֵÿθıʱȡһµıţʹ֮ʹܹʶģ͵ı仯
+		uint64_t NextGeneration()
+		{
+			static std::atomic<uint64_t> generation(0);
+			return ++generation;
+		}
+
+		// ӺţŻеλãõµӣsplitmix64
+		uint64_t TreeSeed(uint64_t seed, uint64_t tree)
+		{
+			uint64_t z = seed + (tree + 1) * 0x9E3779B97F4A7C15ULL;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			return z ^ (z >> 31);
+		}
+	}
+
+	Forest::Forest() :
+		m_randomizer(new Randomizer()),
+		m_numTreesToCreate(10),
+		m_subSamplingSize(0),
+		m_treeBlockBytes(0),
+		m_samplesPerBlock(0),
+		m_interleave(8),
+		m_ingestCalls(0),
+		m_sparseRows(0),
+		m_generation(NextGeneration()),
+		m_contamination((double)0.0),
+		m_thresholdSampleRows(0),
+		m_thresholdRowsSeen(0),
+		m_thresholdRandom(0x5EED),
+		m_outlierThreshold(-HUGE_VAL),
+		m_memoryBudget(0),
+		m_depthLimit(0),
+		m_nodeLimit(0),
+		m_treeStart(0),
+		m_treeTruncated(false),
+		m_subtreeDepth(0),
+		m_lazy(false),
+		m_buildingSubtree(false),
+		m_treeSeed(0),
+		m_buildNodes(&m_nodes),
+		m_buildCategoryTable(&m_categoryTable),
+		m_buildSnapshot(NULL),
+		m_buildListed(NULL)
+	{
+		memset(&m_budgetReport, 0, sizeof(m_budgetReport));
+		CreateIngestShards();
+	}
+
+	Forest::Forest(uint32_t numTrees, uint32_t subSamplingSize) :
+		m_randomizer(new Randomizer()),
+		m_numTreesToCreate(numTrees),
+		m_subSamplingSize(subSamplingSize),
+		m_treeBlockBytes(0),
+		m_samplesPerBlock(0),
+		m_interleave(8),
+		m_ingestCalls(0),
+		m_sparseRows(0),
+		m_generation(NextGeneration()),
+		m_contamination((double)0.0),
+		m_thresholdSampleRows(0),
+		m_thresholdRowsSeen(0),
+		m_thresholdRandom(0x5EED),
+		m_outlierThreshold(-HUGE_VAL),
+		m_memoryBudget(0),
+		m_depthLimit(0),
+		m_nodeLimit(0),
+		m_treeStart(0),
+		m_treeTruncated(false),
+		m_subtreeDepth(0),
+		m_lazy(false),
+		m_buildingSubtree(false),
+		m_treeSeed(0),
+		m_buildNodes(&m_nodes),
+		m_buildCategoryTable(&m_categoryTable),
+		m_buildSnapshot(NULL),
+		m_buildListed(NULL)
+	{
+		memset(&m_budgetReport, 0, sizeof(m_budgetReport));
+		CreateIngestShards();
+	}
+
+	Forest::~Forest()
+	{
+		DestroyRandomizer();
+		Destroy();
+	}
+
+	void Forest::SetRandomizer(Randomizer* newRandomizer)
+	{
+		DestroyRandomizer();
+		m_randomizer = newRandomizer;
+	}
+
+	//ÿӵ֪бС
+	//ӦΨһֵ
+	void Forest::AddSample(const Sample& sample)
+	{
+        // ֱӴ洢ֻ
+		const FeaturePtrList& features = sample.Features();
+		FeaturePtrList::const_iterator featureIter = features.begin();
+		while (featureIter != features.end())
+		{
+			const FeaturePtr feature = (*featureIter);
+			const std::string& featureName = feature->Name();
+			uint64_t featureValue = feature->Value();
+
+			// ֵ
+			uint32_t featureIndex = 0;
+			if (!ProjectedFeatureIndex(featureName, featureIndex))
+			{
+				++featureIter;
+				continue;
+			}
+			m_featureValues[featureName].insert(featureValue);
+
+			++featureIter;
+		}
+
+		size_t slot = 0;
+		if (ReserveThresholdRow(slot))
+		{
+			SparseSample& row = m_thresholdRows[slot].second;
+			featureIter = features.begin();
+			while (featureIter != features.end())
+			{
+				SparseFeature feature = { 0, (*featureIter)->Value() };
+				if (ProjectedFeatureIndex((*featureIter)->Name(), feature.featureIndex))
+				{
+					row.push_back(feature);
+				}
+				++featureIter;
+			}
+		}
+	}
+
+	//ͶӰʱtrueֻһ
+	//ͶӰ־ԤãͶӰ֮ûȻͶӰ
+	bool Forest::ProjectedFeatureIndex(const std::string& featureName, uint32_t& featureIndex)
+	{
+		FeatureNameToIndexMap::const_iterator indexIter = m_featureIndices.find(featureName);
+		if (indexIter != m_featureIndices.end())
+		{
+			featureIndex = (*indexIter).second;
+			return m_projectedFeatures[featureIndex] != 0;
+		}
+		if (!IsProjected(featureName))
+		{
+			return false;
+		}
+		featureIndex = FeatureIndex(featureName);
+		return true;
+	}
+
+	void Forest::CreateIngestShards()
+	{
+		size_t numShards = std::min(std::max((size_t)std::thread::hardware_concurrency(), (size_t)1) * 2, (size_t)64);
+		for (size_t i = 0; i < numShards; ++i)
+		{
+			m_ingestShards.push_back(std::unique_ptr<IngestShard>(new IngestShard()));
+		}
+	}
+
+	//صǰ߳ʹõĲɼƬ̰߳״εõ˳䵽Ƭ
+	IngestShard& Forest::CurrentIngestShard()
+	{
+		static std::atomic<size_t> nextThreadSlot(0);
+		static thread_local size_t threadSlot = nextThreadSlot++;
+		return *m_ingestShards[threadSlot % m_ingestShards.size()];
+	}
+
+	void Forest::AddSampleConcurrent(const Sample& sample)
+	{
+		IngestShard& shard = CurrentIngestShard();
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		uint64_t call = m_ingestCalls++;
+
+		const FeaturePtrList& features = sample.Features();
+		FeaturePtrList::const_iterator featureIter = features.begin();
+		for (size_t column = 0; featureIter != features.end(); ++column, ++featureIter)
+		{
+			const FeaturePtr feature = (*featureIter);
+			if (IsProjected(feature->Name()))
+			{
+				ShardBuffer(shard, feature->Name(), call, column).Add(feature->Value());
+			}
+		}
+	}
+
+	void Forest::AddSamplesConcurrent(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples)
+	{
+		IngestShard& shard = CurrentIngestShard();
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		uint64_t call = m_ingestCalls++;
+
+		size_t numColumns = featureNames.size();
+		for (size_t column = 0; column < numColumns; ++column)
+		{
+			if (!IsProjected(featureNames[column]))
+			{
+				continue;
+			}
+			IngestBuffer& buffer = ShardBuffer(shard, featureNames[column], call, column);
+			for (size_t row = 0; row < numSamples; ++row)
+			{
+				buffer.Add(values[row * numColumns + column]);
+			}
+		}
+	}
+
+	//طƬĻһγʱ¼ֵλá
+	IngestBuffer& Forest::ShardBuffer(IngestShard& shard, const std::string& featureName, uint64_t call, size_t column)
+	{
+		std::map<std::string, IngestBuffer>::iterator bufferIter = shard.buffers.find(featureName);
+		if (bufferIter == shard.buffers.end())
+		{
+			bufferIter = shard.buffers.insert(std::make_pair(featureName, IngestBuffer())).first;
+			(*bufferIter).second.firstCall = call;
+			(*bufferIter).second.firstColumn = column;
+		}
+		return (*bufferIter).second;
+	}
+
+	//зƬеֵѵշƬһγֵĵúٷ
+	//밴˳вɼʱͬ
+	void Forest::MergeIngestShards()
+	{
+		typedef std::pair<std::pair<uint64_t, size_t>, std::string> FirstSeen;
+		std::map<std::string, std::pair<uint64_t, size_t> > newFeatures;
+		for (size_t i = 0; i < m_ingestShards.size(); ++i)
+		{
+			IngestShard& shard = *m_ingestShards[i];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+
+			std::map<std::string, IngestBuffer>::const_iterator bufferIter = shard.buffers.begin();
+			while (bufferIter != shard.buffers.end())
+			{
+				const std::string& featureName = (*bufferIter).first;
+				std::pair<uint64_t, size_t> position((*bufferIter).second.firstCall, (*bufferIter).second.firstColumn);
+				if (m_featureIndices.count(featureName) == 0 && (newFeatures.count(featureName) == 0 || position < newFeatures[featureName]))
+				{
+					newFeatures[featureName] = position;
+				}
+				++bufferIter;
+			}
+		}
+
+		std::vector<FirstSeen> order;
+		order.reserve(newFeatures.size());
+		for (std::map<std::string, std::pair<uint64_t, size_t> >::const_iterator newIter = newFeatures.begin(); newIter != newFeatures.end(); ++newIter)
+		{
+			order.push_back(FirstSeen((*newIter).second, (*newIter).first));
+		}
+		std::sort(order.begin(), order.end());
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			FeatureIndex(order[i].second);
+		}
+
+		for (size_t i = 0; i < m_ingestShards.size(); ++i)
+		{
+			IngestShard& shard = *m_ingestShards[i];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+
+			std::map<std::string, IngestBuffer>::const_iterator bufferIter = shard.buffers.begin();
+			while (bufferIter != shard.buffers.end())
+			{
+				const std::vector<uint64_t>& bufferValues = (*bufferIter).second.values;
+				AddColumn((*bufferIter).first, bufferValues.data(), bufferValues.size(), 1);
+				++bufferIter;
+			}
+			shard.buffers.clear();
+		}
+	}
+
+	//˳
+	uint32_t Forest::FeatureIndex(const std::string& featureName)
+	{
+		FeatureNameToIndexMap::const_iterator indexIter = m_featureIndices.find(featureName);
+		if (indexIter != m_featureIndices.end())
+		{
+			return (*indexIter).second;
+		}
+
+		if (m_featureNames.size() > PackedNode::FEATURE_INDEX_MASK)
+		{
+			throw std::length_error("Forest: more than 2^24 features");
+		}
+
+		uint32_t featureIndex = (uint32_t)m_featureNames.size();
+		m_featureIndices.insert(std::make_pair(featureName, featureIndex));
+		m_featureNames.push_back(featureName);
+		m_projectedFeatures.push_back(IsProjected(featureName) ? 1 : 0);
+		return featureIndex;
+	}
+
+
+	//еֵеֵгֵгֵΪ׷Ӷƶָֻ׷֮ǰЧ
+	inline const uint64_t* Forest::RangeValues(size_t feature, const ValueRange& range) const
+	{
+		const std::vector<uint64_t>& values = range.listed ? (*m_buildListed) : m_buildSnapshot->values[feature];
+		return values.data() + range.begin;
+	}
+
+	//ڵ㰴׷ӵm_nodesӳ׷ӵԼĽڵ㣩Ϊǵݹ麯
+	//ָʾݹĵǰȣpositionǽڵеλãΪ1ӽڵΪ2p2p+1ûдڵ򷵻false
+	//rangesÿǰֵϣ͵Сѡ䣬ʱrangesǰͬݹ鲻κֵ
+	bool Forest::CreateTree(std::vector<ValueRange>& ranges, size_t depth, uint64_t position)
+	{
+		PackedNodeList& nodes = *m_buildNodes;
+
+		// Sanity check.
+		if (ranges.size() <= 1)
+		{
+			return false;
+		}
+
+		// ȣֹͣ
+		if ((m_depthLimit > 0) && (depth >= m_depthLimit))
+		{
+			return false;
+		}
+
+		// ﵽڴԤĽڵʱֹͣ
+		if ((m_nodeLimit > 0) && (nodes.size() - m_treeStart >= m_nodeLimit))
+		{
+			m_treeTruncated = true;
+			return false;
+		}
+
+		// ʱӺλȷӳٴ
+		if ((m_subtreeDepth > 0) && (depth == m_subtreeDepth) && !m_buildingSubtree)
+		{
+			return CreateSubtree(ranges, depth, position);
+		}
+
+		// ѡһ
+		size_t selectedFeature = (size_t)m_randomizer->RandUInt64(0, ranges.size() - 1);
+
+		// ȡֵбв֡
+		const ValueRange range = ranges[selectedFeature];
+		size_t numValues = range.end - range.begin;
+		if (numValues == 0)
+		{
+			return false;
+		}
+		const uint64_t* values = RangeValues(selectedFeature, range);
+
+		// Ӽѡ
+		uint32_t featureIndex = m_buildSnapshot->indices[selectedFeature];
+		const std::vector<uint8_t>& categorical = m_buildSnapshot->categorical;
+		if (featureIndex < categorical.size() && categorical[featureIndex] && values[numValues - 1] < MAX_CATEGORIES)
+		{
+			return CreateCategoricalNode(ranges, selectedFeature, depth, position);
+		}
+
+		// ѡһֵ.
+		size_t splitValueIndex = 0;
+		if (numValues > 1)
+		{
+			splitValueIndex = (size_t)m_randomizer->RandUInt64(0, numValues - 1);
+		}
+		uint64_t splitValue = values[splitValueIndex];
+
+		// ڵֵ
+		size_t nodeIndex = nodes.size();
+		PackedNode node;
+		node.splitValue = splitValue;
+		node.featureAndFlags = featureIndex;
+		node.childOffset = 0;
+		nodes.push_back(node);
+
+		// ֵ֮ǰֵߣֵ֮ұߣ߶ͬһһΡ
+		// ڵǰڵ֮
+		ranges[selectedFeature].end = range.begin + splitValueIndex;
+		if (CreateTree(ranges, depth + 1, 2 * position))
+		{
+			nodes[nodeIndex].featureAndFlags |= PackedNode::FLAG_HAS_LEFT;
+		}
+
+		// 
+		if (splitValueIndex < numValues - 1)
+		{
+			ranges[selectedFeature].begin = range.begin + splitValueIndex + 1;
+			ranges[selectedFeature].end = range.end;
+
+			size_t rightIndex = nodes.size();
+			if (CreateTree(ranges, depth + 1, 2 * position + 1))
+			{
+				nodes[nodeIndex].featureAndFlags |= PackedNode::FLAG_HAS_RIGHT;
+				nodes[nodeIndex].childOffset = (uint32_t)(rightIndex - nodeIndex);
+			}
+		}
+
+		ranges[selectedFeature] = range;
+		return true;
+	}
+
+	//Ϊڵ㼰ѡһǿӼߣһ̶ߣ
+	//һ̶ұߣÿ1/2ĸʷߡֻһʱұߣֵһ¡
+	//ߵ׷ӵгֵĩβ֮ɾ
+	bool Forest::CreateCategoricalNode(std::vector<ValueRange>& ranges, size_t feature, size_t depth, uint64_t position)
+	{
+		PackedNodeList& nodes = *m_buildNodes;
+		std::vector<uint64_t>& categoryTable = *m_buildCategoryTable;
+		std::vector<uint64_t>& listed = *m_buildListed;
+		const ValueRange range = ranges[feature];
+		size_t numCategories = range.end - range.begin;
+
+		// ߵ׷ӣұߵʱnumCategories֮Ƶߵ֮
+		size_t listedStart = listed.size();
+		listed.resize(listedStart + 2 * numCategories);
+		const uint64_t* categories = RangeValues(feature, range);
+		size_t numLeft = 0;
+		size_t numRight = 0;
+		if (numCategories > 1)
+		{
+			size_t leftIndex = (size_t)m_randomizer->RandUInt64(0, numCategories - 1);
+			size_t rightIndex = (size_t)m_randomizer->RandUInt64(0, numCategories - 2);
+			if (rightIndex >= leftIndex)
+			{
+				++rightIndex;
+			}
+
+			uint64_t bits = 0;
+			for (size_t index = 0; index < numCategories; ++index)
+			{
+				if (index % 64 == 0)
+				{
+					bits = m_randomizer->Rand();
+				}
+				bool left = (index == leftIndex) || ((index != rightIndex) && (bits & 1));
+				bits >>= 1;
+
+				if (left)
+				{
+					listed[listedStart + numLeft++] = categories[index];
+				}
+				else
+				{
+					listed[listedStart + numCategories + numRight++] = categories[index];
+				}
+			}
+		}
+		else
+		{
+			listed[listedStart + numCategories] = categories[0];
+			numRight = 1;
+		}
+		std::copy(listed.begin() + listedStart + numCategories, listed.begin() + listedStart + numCategories + numRight, listed.begin() + listedStart + numLeft);
+		listed.resize(listedStart + numCategories);
+
+		// ߵ𼯺ϣС64ֱӷsplitValueУдλͼ
+		const uint64_t* leftCategories = listed.data() + listedStart;
+		size_t nodeIndex = nodes.size();
+		PackedNode node;
+		node.splitValue = 0;
+		node.featureAndFlags = m_buildSnapshot->indices[feature] | PackedNode::FLAG_CATEGORICAL;
+		node.childOffset = 0;
+		if (numLeft > 0 && leftCategories[numLeft - 1] >= 64)
+		{
+			size_t numWords = (size_t)(leftCategories[numLeft - 1] / 64 + 1);
+			node.splitValue = categoryTable.size();
+			node.featureAndFlags |= PackedNode::FLAG_CATEGORY_TABLE;
+			categoryTable.push_back(numWords);
+			categoryTable.resize(categoryTable.size() + numWords, 0);
+		}
+		for (size_t index = 0; index < numLeft; ++index)
+		{
+			uint64_t category = leftCategories[index];
+			if (node.HasCategoryTable())
+			{
+				categoryTable[node.splitValue + 1 + category / 64] |= (uint64_t)1 << (category % 64);
+			}
+			else
+			{
+				node.splitValue |= (uint64_t)1 << category;
+			}
+		}
+		nodes.push_back(node);
+
+		// ڵǰڵ֮
+		ValueRange leftRange = { listedStart, listedStart + numLeft, true };
+		ranges[feature] = leftRange;
+		if (CreateTree(ranges, depth + 1, 2 * position))
+		{
+			nodes[nodeIndex].featureAndFlags |= PackedNode::FLAG_HAS_LEFT;
+		}
+
+		if (numCategories > 1)
+		{
+			ValueRange rightRange = { listedStart + numLeft, listedStart + numCategories, true };
+			ranges[feature] = rightRange;
+
+			size_t rightIndex = nodes.size();
+			if (CreateTree(ranges, depth + 1, 2 * position + 1))
+			{
+				nodes[nodeIndex].featureAndFlags |= PackedNode::FLAG_HAS_RIGHT;
+				nodes[nodeIndex].childOffset = (uint32_t)(rightIndex - nodeIndex);
+			}
+		}
+
+		ranges[feature] = range;
+		listed.resize(listedStart);
+		return true;
+	}
+
+	//ȴʹӺλȷӳٴʱֻȷǷΪ
+	//CreateTreeͬȡѡĵһȻдռλڵ㣬¼Ҫֵϡ
+	bool Forest::CreateSubtree(std::vector<ValueRange>& ranges, size_t depth, uint64_t position)
+	{
+		uint64_t subtreeSeed = TreeSeed(m_treeSeed, position);
+		Randomizer subtreeRandomizer(subtreeSeed);
+		if (!m_lazy)
+		{
+			Randomizer* randomizer = m_randomizer;
+			m_randomizer = &subtreeRandomizer;
+			m_buildingSubtree = true;
+			bool created = CreateTree(ranges, depth, position);
+			m_buildingSubtree = false;
+			m_randomizer = randomizer;
+			return created;
+		}
+
+		size_t selectedFeature = (size_t)subtreeRandomizer.RandUInt64(0, ranges.size() - 1);
+		if (ranges[selectedFeature].begin == ranges[selectedFeature].end)
+		{
+			return false;
+		}
+
+		std::unique_ptr<LazySubtree> subtree(new LazySubtree());
+		subtree->snapshot = m_lazySnapshot;
+		subtree->ranges = ranges;
+		subtree->seed = subtreeSeed;
+		subtree->position = position;
+		subtree->depth = (uint32_t)depth;
+		subtree->depthLimit = m_depthLimit;
+		subtree->built = false;
+
+		// ֵļǿеһΣֻҪг
+		for (size_t feature = 0; feature < ranges.size(); ++feature)
+		{
+			ValueRange& range = subtree->ranges[feature];
+			if (range.listed)
+			{
+				const uint64_t* values = RangeValues(feature, ranges[feature]);
+				range.begin = subtree->values.size();
+				subtree->values.insert(subtree->values.end(), values, values + (ranges[feature].end - ranges[feature].begin));
+				range.end = subtree->values.size();
+			}
+		}
+
+		PackedNode node;
+		node.splitValue = m_lazySubtrees.size();
+		node.featureAndFlags = PackedNode::FLAG_LAZY;
+		node.childOffset = 0;
+		m_buildNodes->push_back(node);
+		m_lazySubtrees.push_back(std::move(subtree));
+		return true;
+	}
+
+	//ӳһηʱമУÿֻһΡ
+	const LazySubtree& Forest::BuiltLazySubtree(uint64_t subtreeIndex) const
+	{
+		LazySubtree& subtree = *m_lazySubtrees[(size_t)subtreeIndex];
+		if (!subtree.built.load(std::memory_order_acquire))
+		{
+			std::lock_guard<std::mutex> lock(m_lazyMutex);
+			if (!subtree.built.load(std::memory_order_relaxed))
+			{
+				// ֻдԼĽڵ㣬Լʱ滻Ĵ״ֲ̬ȡЩ״̬
+				const_cast<Forest*>(this)->BuildLazySubtree(subtree);
+				subtree.built.store(true, std::memory_order_release);
+			}
+		}
+		return subtree;
+	}
+
+	//ü¼ֵϺӳʱͬ
+	void Forest::BuildLazySubtree(LazySubtree& subtree)
+	{
+		Randomizer subtreeRandomizer(subtree.seed);
+		Randomizer* randomizer = m_randomizer;
+		PackedNodeList* buildNodes = m_buildNodes;
+		std::vector<uint64_t>* buildCategoryTable = m_buildCategoryTable;
+		const ValueSnapshot* buildSnapshot = m_buildSnapshot;
+		std::vector<uint64_t>* buildListed = m_buildListed;
+		uint32_t depthLimit = m_depthLimit;
+		size_t nodeLimit = m_nodeLimit;
+
+		m_randomizer = &subtreeRandomizer;
+		m_buildNodes = &subtree.nodes;
+		m_buildCategoryTable = &subtree.categoryTable;
+		m_buildSnapshot = subtree.snapshot.get();
+		m_buildListed = &subtree.values;
+		m_depthLimit = subtree.depthLimit;
+		m_nodeLimit = 0;
+		m_buildingSubtree = true;
+		CreateTree(subtree.ranges, subtree.depth, subtree.position);
+		m_buildingSubtree = false;
+		m_nodeLimit = nodeLimit;
+		m_depthLimit = depthLimit;
+		m_buildListed = buildListed;
+		m_buildSnapshot = buildSnapshot;
+		m_buildCategoryTable = buildCategoryTable;
+		m_buildNodes = buildNodes;
+		m_randomizer = randomizer;
+
+		subtree.snapshot.reset();
+		std::vector<ValueRange>().swap(subtree.ranges);
+		std::vector<uint64_t>().swap(subtree.values);
+	}
+
+	void Forest::SetLazySubtrees(uint32_t depth, bool lazy)
+	{
+		m_subtreeDepth = std::min(depth, (uint32_t)62); // λҪŽ64λ
+		m_lazy = lazy;
+	}
+
+	size_t Forest::NumLazySubtrees() const
+	{
+		size_t numLazySubtrees = 0;
+		for (size_t i = 0; i < m_lazySubtrees.size(); ++i)
+		{
+			numLazySubtrees += m_lazySubtrees[i]->built.load(std::memory_order_acquire) ? 0 : 1;
+		}
+		return numLazySubtrees;
+	}
+
+	void Forest::BuildLazySubtrees()
+	{
+		if (m_lazyTrees.empty())
+		{
+			return;
+		}
+
+		// θÿռλڵȷŻõʱͬδѹѹ
+		PackedNodeList nodes;
+		PackedNodeList spliced;
+		std::vector<uint32_t> treeRoots(m_treeRoots.size());
+		size_t lazyTree = 0;
+		for (size_t tree = 0; tree < m_treeRoots.size(); ++tree)
+		{
+			treeRoots[tree] = (uint32_t)nodes.size();
+			if (lazyTree < m_lazyTrees.size() && m_lazyTrees[lazyTree] == tree)
+			{
+				spliced.clear();
+				SpliceSubtree(m_nodes.data(), m_treeRoots[tree], 0, spliced);
+				CompactSubtree(spliced.data(), 0, nodes);
+				++lazyTree;
+			}
+			else
+			{
+				size_t treeEnd = (tree + 1 < m_treeRoots.size()) ? m_treeRoots[tree + 1] : m_nodes.size();
+				nodes.insert(nodes.end(), m_nodes.begin() + m_treeRoots[tree], m_nodes.begin() + treeEnd);
+			}
+		}
+
+		m_nodes.swap(nodes);
+		m_treeRoots.swap(treeRoots);
+		m_lazyTrees.clear();
+		m_lazySubtrees.clear();
+		m_lazySnapshot.reset();
+	}
+
+	//һδѹдsplicedռλڵ㻻Ҫʱȴλͼ׷ӵλͼ
+	void Forest::SpliceSubtree(const PackedNode* nodes, uint32_t nodeIndex, uint64_t categoryOffset, PackedNodeList& spliced)
+	{
+		const PackedNode& node = nodes[nodeIndex];
+		if (node.IsLazy())
+		{
+			const LazySubtree& subtree = BuiltLazySubtree(node.splitValue);
+			uint64_t subtreeCategoryOffset = m_categoryTable.size();
+			m_categoryTable.insert(m_categoryTable.end(), subtree.categoryTable.begin(), subtree.categoryTable.end());
+			SpliceSubtree(subtree.nodes.data(), 0, subtreeCategoryOffset, spliced);
+			return;
+		}
+
+		size_t splicedIndex = spliced.size();
+		spliced.push_back(node);
+		if (node.HasCategoryTable())
+		{
+			spliced[splicedIndex].splitValue += categoryOffset;
+		}
+		if (node.HasLeft())
+		{
+			SpliceSubtree(nodes, nodeIndex + 1, categoryOffset, spliced);
+		}
+		if (node.HasRight())
+		{
+			size_t rightIndex = spliced.size();
+			SpliceSubtree(nodes, nodeIndex + node.childOffset, categoryOffset, spliced);
+			spliced[splicedIndex].childOffset = (uint32_t)(rightIndex - splicedIndex);
+		}
+	}
+
+	void Forest::SetCategorical(const std::string& featureName)
+	{
+		uint32_t featureIndex = FeatureIndex(featureName);
+		if (m_categoricalFeatures.size() <= featureIndex)
+		{
+			m_categoricalFeatures.resize(featureIndex + 1, 0);
+		}
+		m_categoricalFeatures[featureIndex] = 1;
+	}
+
+	//Ƿ߽ڵߣֵȽϷֵǷߵļС
+	inline bool Forest::GoesLeft(const PackedNode& node, uint64_t value, const uint64_t* categoryTable) const
+	{
+		if (!node.IsCategorical())
+		{
+			return value < node.splitValue;
+		}
+		if (!node.HasCategoryTable())
+		{
+			return value < 64 && ((node.splitValue >> value) & 1) != 0;
+		}
+
+		const uint64_t* table = categoryTable + node.splitValue;
+		return value / 64 < table[0] && ((table[1 + value / 64] >> (value % 64)) & 1) != 0;
+	}
+
+	inline bool Forest::GoesLeft(const PackedNode& node, uint64_t value) const
+	{
+		return GoesLeft(node, value, m_categoryTable.data());
+	}
+
+	//ָ캯֡ڴԤһɲʱfalse
+	bool Forest::Create()
+	{
+		Grow(m_numTreesToCreate);
+		return !m_budgetReport.overBudget;
+	}
+
+	//ɭnumTreesеֲ䡣ɭ
+	size_t Forest::Grow(uint32_t numTrees)
+	{
+		return GrowTrees(numTrees, NULL, 0, true);
+	}
+
+	size_t Forest::GrowShard(uint64_t seed, uint32_t firstTree, uint32_t numTrees)
+	{
+		return GrowTrees(numTrees, &seed, firstTree, true);
+	}
+
+	//numTreesseedΪNULLʱiʹ (*seed, firstSeededTree + i) ȷʹm_randomizer
+	//updateThresholdΪfalseʱ¼ֵɵе֮㡣
+	size_t Forest::GrowTrees(uint32_t numTrees, const uint64_t* seed, uint32_t firstSeededTree, bool updateThreshold)
+	{
+		MergeIngestShards();
+		AddSparseDefaults();
+
+		// ѵֵմÿֵǿе䡣ӳٵԺŴա
+		std::shared_ptr<ValueSnapshot> snapshot(new ValueSnapshot());
+		FeatureNameToValuesMap::const_iterator featureIter = m_featureValues.begin();
+		while (featureIter != m_featureValues.end())
+		{
+			snapshot->names.push_back((*featureIter).first);
+			snapshot->values.push_back(std::vector<uint64_t>((*featureIter).second.begin(), (*featureIter).second.end()));
+			snapshot->indices.push_back(m_featureIndices.at((*featureIter).first));
+			++featureIter;
+		}
+		snapshot->categorical = m_categoricalFeatures;
+		if ((m_subtreeDepth > 0) && m_lazy)
+		{
+			m_lazySnapshot = snapshot;
+		}
+
+		std::vector<ValueRange> ranges(snapshot->values.size());
+		for (size_t feature = 0; feature < ranges.size(); ++feature)
+		{
+			ValueRange range = { 0, snapshot->values[feature].size(), false };
+			ranges[feature] = range;
+		}
+		std::vector<uint64_t> listed;
+		m_buildSnapshot = snapshot.get();
+		m_buildListed = &listed;
+
+		uint32_t numTreesToBuild = PlanBudget(numTrees);
+		size_t firstTree = m_treeRoots.size();
+		size_t firstNode = m_nodes.size();
+		m_treeRoots.reserve(m_treeRoots.size() + numTreesToBuild);
+
+		// ÿúѹδѹĽڵֻһ
+		for (size_t i = 0; i < numTreesToBuild; ++i)
+		{
+			m_treeStart = m_nodes.size();
+			m_treeTruncated = false;
+
+			Randomizer* randomizer = m_randomizer;
+			std::unique_ptr<Randomizer> treeRandomizer;
+			if (seed)
+			{
+				m_treeSeed = TreeSeed(*seed, firstSeededTree + i);
+				treeRandomizer.reset(new Randomizer(m_treeSeed));
+				m_randomizer = treeRandomizer.get();
+			}
+			else if (m_subtreeDepth > 0)
+			{
+				m_treeSeed = m_randomizer->Rand();
+			}
+			size_t numLazySubtrees = m_lazySubtrees.size();
+			bool created = CreateTree(ranges, 0, 1);
+			m_randomizer = randomizer;
+
+			if (created)
+			{
+				m_treeRoots.push_back((uint32_t)m_treeStart);
+				// ռλڵŻ֮ѹ
+				if (m_lazySubtrees.size() > numLazySubtrees)
+				{
+					m_lazyTrees.push_back((uint32_t)(m_treeRoots.size() - 1));
+				}
+				else
+				{
+					CompactTrees(m_treeRoots.size() - 1);
+				}
+				m_budgetReport.treesTruncated += m_treeTruncated ? 1 : 0;
+			}
+		}
+		m_buildListed = NULL;
+		m_buildSnapshot = NULL;
+		m_nodes.shrink_to_fit();
+		m_generation = NextGeneration();
+
+		if (updateThreshold)
+		{
+			UpdateOutlierThreshold();
+		}
+
+		m_budgetReport.treesBuilt = (uint32_t)(m_treeRoots.size() - firstTree);
+		m_budgetReport.treeBytesUsed = (m_nodes.size() - firstNode) * sizeof(PackedNode) + m_budgetReport.treesBuilt * sizeof(uint32_t);
+		return m_treeRoots.size();
+	}
+
+	//ڴԤȷ޺ͽڵޣҪûԤʱֻʹùʱȡ
+	uint32_t Forest::PlanBudget(uint32_t numTrees)
+	{
+		const size_t minNodesPerTree = 15; // 4ȫ
+		const size_t bytesPerNode = sizeof(PackedNode);
+		const size_t bytesPerTree = sizeof(uint32_t);
+
+		memset(&m_budgetReport, 0, sizeof(m_budgetReport));
+		m_budgetReport.budgetBytes = m_memoryBudget;
+		m_budgetReport.treesRequested = numTrees;
+		m_depthLimit = m_subSamplingSize;
+		m_nodeLimit = 0;
+		if (m_memoryBudget == 0)
+		{
+			m_budgetReport.depthLimit = m_depthLimit;
+			return numTrees;
+		}
+
+		ForestMemoryUsage usage = MemoryUsage();
+		m_budgetReport.trainingBytes = usage.trainingBytes;
+		m_budgetReport.existingTreeBytes = usage.treeBytes;
+		size_t available = m_memoryBudget > usage.Total() ? m_memoryBudget - usage.Total() : 0;
+
+		// һʱʱڴ棺ѵֵգӳٴʱձ꣬Ѿѵ״̬
+		// ʱݹÿһгѡѹʱһĽڵ㡣
+		size_t snapshotBytes = 0;
+		size_t largestCategoricalBytes = 0;
+		FeatureNameToValuesMap::const_iterator featureIter = m_featureValues.begin();
+		while (featureIter != m_featureValues.end())
+		{
+			size_t valueBytes = (*featureIter).second.size() * sizeof(uint64_t);
+			snapshotBytes += sizeof(std::string) + (*featureIter).first.capacity() + valueBytes + sizeof(uint32_t) + sizeof(ValueRange);
+			uint32_t featureIndex = m_featureIndices.at((*featureIter).first);
+			if (featureIndex < m_categoricalFeatures.size() && m_categoricalFeatures[featureIndex])
+			{
+				largestCategoricalBytes = std::max(largestCategoricalBytes, valueBytes);
+			}
+			++featureIter;
+		}
+		if ((m_subtreeDepth > 0) && m_lazy)
+		{
+			snapshotBytes = 0;
+		}
+
+		// ʱڴȡȣȡʣµԤ㣺Ȳʱڴȷȣȿ۳ʱڴȷһΡ
+		// ڶεȲʱڴ治ᳬ۳Ĳ֡
+		uint32_t numTreesToBuild = numTrees;
+		size_t buildBytes = 0;
+		size_t treeBytesAllowed = 0;
+		size_t nodesPerTree = 0;
+		uint32_t depthLimit = 1;
+		for (int pass = 0; pass < 2; ++pass)
+		{
+			treeBytesAllowed = available > buildBytes ? available - buildBytes : 0;
+
+			// ֮ƽֽڵ㣬ÿĽڵ̫ʱ
+			numTreesToBuild = numTrees;
+			nodesPerTree = numTrees > 0 ? (treeBytesAllowed / numTrees - std::min(treeBytesAllowed / numTrees, bytesPerTree)) / bytesPerNode : 0;
+			if (nodesPerTree < minNodesPerTree)
+			{
+				numTreesToBuild = (uint32_t)std::min((size_t)numTrees, treeBytesAllowed / (minNodesPerTree * bytesPerNode + bytesPerTree));
+				nodesPerTree = minNodesPerTree;
+			}
+
+			// ȡڵɵȫȣÿسȣƫȴ
+			// ڵֻǱ֤Ԥһơ
+			depthLimit = 1;
+			while (((size_t)2 << depthLimit) - 1 <= nodesPerTree)
+			{
+				++depthLimit;
+			}
+			if (m_subSamplingSize > 0 && m_subSamplingSize < depthLimit)
+			{
+				depthLimit = m_subSamplingSize;
+			}
+			if (pass == 0)
+			{
+				buildBytes = snapshotBytes + (depthLimit + 1) * largestCategoricalBytes + nodesPerTree * bytesPerNode;
+			}
+		}
+		m_depthLimit = depthLimit;
+		m_nodeLimit = nodesPerTree;
+
+		m_budgetReport.buildBytes = buildBytes;
+		m_budgetReport.treeBytesAllowed = treeBytesAllowed;
+		m_budgetReport.overBudget = (numTrees > 0) && (numTreesToBuild == 0);
+		m_budgetReport.depthLimit = m_depthLimit;
+		m_budgetReport.nodesPerTreeLimit = m_nodeLimit;
+		return numTreesToBuild;
+	}
+
+	//ѹfirstTreeʼλm_nodesĩβûӽڵҶӲ븸ڵ㣬ֽ䡣
+	void Forest::CompactTrees(size_t firstTree)
+	{
+		if (firstTree >= m_treeRoots.size())
+		{
+			return;
+		}
+
+		PackedNodeList compacted;
+		compacted.reserve(m_nodes.size() - m_treeRoots[firstTree]);
+
+		for (size_t tree = firstTree; tree < m_treeRoots.size(); ++tree)
+		{
+			uint32_t oldRoot = m_treeRoots[tree];
+			m_treeRoots[tree] = (uint32_t)(m_treeRoots[firstTree] + compacted.size());
+			CompactSubtree(m_nodes.data(), oldRoot, compacted);
+		}
+
+		m_nodes.resize(m_treeRoots[firstTree]);
+		m_nodes.insert(m_nodes.end(), compacted.begin(), compacted.end());
+	}
+
+	//һδѹдcompactedҶӽڵ㲢븸ڵı־
+	void Forest::CompactSubtree(const PackedNode* nodes, uint32_t nodeIndex, PackedNodeList& compacted) const
+	{
+		const PackedNode& node = nodes[nodeIndex];
+		uint32_t leftIndex = nodeIndex + 1;
+		uint32_t rightIndex = nodeIndex + node.childOffset;
+
+		bool leftIsLeaf = node.HasLeft() && nodes[leftIndex].IsLeaf();
+		bool rightIsLeaf = node.HasRight() && nodes[rightIndex].IsLeaf();
+
+		// Ҷӵ붼ܷŽ16λֻѹұߵҶӡ
+		if (leftIsLeaf && rightIsLeaf && (nodes[leftIndex].FeatureIndex() > 0xFFFF || nodes[rightIndex].FeatureIndex() > 0xFFFF))
+		{
+			leftIsLeaf = false;
+		}
+
+		size_t compactedIndex = compacted.size();
+		PackedNode compactedNode = node;
+		compactedNode.childOffset = 0;
+		if (leftIsLeaf && rightIsLeaf)
+		{
+			compactedNode.featureAndFlags |= PackedNode::FLAG_LEFT_LEAF | PackedNode::FLAG_RIGHT_LEAF;
+			compactedNode.childOffset = (nodes[leftIndex].FeatureIndex() << 16) | nodes[rightIndex].FeatureIndex();
+		}
+		else if (leftIsLeaf)
+		{
+			compactedNode.featureAndFlags |= PackedNode::FLAG_LEFT_LEAF;
+			compactedNode.childOffset = nodes[leftIndex].FeatureIndex();
+		}
+		else if (rightIsLeaf)
+		{
+			compactedNode.featureAndFlags |= PackedNode::FLAG_RIGHT_LEAF;
+			compactedNode.childOffset = nodes[rightIndex].FeatureIndex();
+		}
+		compacted.push_back(compactedNode);
+
+		if (node.HasLeft() && !leftIsLeaf)
+		{
+			CompactSubtree(nodes, leftIndex, compacted);
+		}
+		if (node.HasRight() && !rightIsLeaf)
+		{
+			size_t compactedRightIndex = compacted.size();
+			CompactSubtree(nodes, rightIndex, compacted);
+			if (!leftIsLeaf)
+			{
+				compacted[compactedIndex].childOffset = (uint32_t)(compactedRightIndex - compactedIndex);
+			}
+		}
+	}
+
+	//ÿstepֱ֤ƽ·ȶȶһӺÿԱ仯tolerance
+	//maxTrees֤Ϊдŵľÿֻ֤һΡɭ
+	size_t Forest::GrowUntilConverged(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples, double tolerance, uint32_t step, uint32_t maxTrees)
+	{
+		step = std::max(step, (uint32_t)1);
+
+		// Ƚ֤֮ÿֱʹá
+		std::vector<uint8_t> present;
+		std::vector<size_t> columns;
+		std::vector<uint32_t> columnFeatures;
+		MergeIngestShards();
+		ResolveColumns(featureNames, present, columns, columnFeatures);
+
+		size_t numColumns = featureNames.size();
+		size_t numFeatures = m_featureNames.size();
+
+		std::vector<uint64_t> resolved(numSamples * numFeatures, 0);
+		for (size_t row = 0; row < numSamples; ++row)
+		{
+			for (size_t i = 0; i < columns.size(); ++i)
+			{
+				resolved[row * numFeatures + columnFeatures[i]] = values[row * numColumns + columns[i]];
+			}
+		}
+
+		// ÿ֤ϵ֮͡еҲ֣һӾͿ֮ǰķȽϡ
+		std::vector<double> depthSums(numSamples, (double)0.0);
+		std::vector<double> previousScores(numSamples, (double)0.0);
+		size_t scoredTrees = 0;
+		size_t previousTrees = 0; // previousScores Ӧ0ʾûпɱȽϵķ
+		size_t numTreesAtStart = m_treeRoots.size();
+
+		while (true)
+		{
+			for (; scoredTrees < m_treeRoots.size(); ++scoredTrees)
+			{
+				for (size_t row = 0; row < numSamples; ++row)
+				{
+					depthSums[row] += Score(resolved.data() + row * numFeatures, present.data(), m_treeRoots[scoredTrees]);
+				}
+			}
+
+			if (previousTrees > 0)
+			{
+				bool converged = true;
+				for (size_t row = 0; row < numSamples && converged; ++row)
+				{
+					double score = depthSums[row] / (double)scoredTrees;
+					converged = fabs(score - previousScores[row]) <= tolerance * std::max(previousScores[row], (double)1.0);
+				}
+				if (converged)
+				{
+					break;
+				}
+			}
+
+			if (m_treeRoots.size() >= maxTrees)
+			{
+				break;
+			}
+			for (size_t row = 0; scoredTrees > 0 && row < numSamples; ++row)
+			{
+				previousScores[row] = depthSums[row] / (double)scoredTrees;
+			}
+			previousTrees = scoredTrees;
+
+			// ֵҪԱе֣ÿֶ¼Ŀȣֹֻ֮ͣһΡ
+			size_t numTreesBefore = m_treeRoots.size();
+			GrowTrees((uint32_t)std::min((size_t)step, maxTrees - numTreesBefore), NULL, 0, false);
+			if (m_treeRoots.size() == numTreesBefore)
+			{
+				break;
+			}
+		}
+
+		if (m_treeRoots.size() > numTreesAtStart)
+		{
+			UpdateOutlierThreshold();
+		}
+		return m_treeRoots.size();
+	}
+
+	//Ϊеֵ顣
+	//ֻͬȡһڵ㰴ƲҵĽһ¡
+	void Forest::ResolveFeatures(const Sample& sample, std::vector<uint64_t>& values, std::vector<uint8_t>& present) const
+	{
+		values.assign(m_featureNames.size(), 0);
+		present.assign(m_featureNames.size(), 0);
+
+		const FeaturePtrList& features = sample.Features();
+		FeaturePtrList::const_iterator featureIter = features.begin();
+		while (featureIter != features.end())
+		{
+			const FeaturePtr feature = (*featureIter);
+			FeatureNameToIndexMap::const_iterator indexIter = m_featureIndices.find(feature->Name());
+			if (indexIter != m_featureIndices.end() && !present[(*indexIter).second])
+			{
+				values[(*indexIter).second] = feature->Value();
+				present[(*indexIter).second] = 1;
+			}
+			++featureIter;
+		}
+	}
+
+	namespace
+	{
+	// ʱ¼ķߡ
+	struct NullVisitor
+	{
+		void OnEdge(uint32_t, bool) {};
+		void OnIsolated(uint32_t, double) {};
+		NullVisitor Branch() const { return *this; };
+	};
+
+	// ¼׵ķߣķѰѵֵ뿪
+	//  weight/ȣԽԽȱʧʱ֧ռһȨء
+	struct ContributionVisitor
+	{
+		double* contributions;
+		double weight;
+
+		void OnEdge(uint32_t, bool) {};
+		void OnIsolated(uint32_t featureIndex, double depth) { contributions[featureIndex] += weight / depth; };
+		ContributionVisitor Branch() const { ContributionVisitor branch = *this; branch.weight /= (double)2.0; return branch; };
+	};
+
+	// ͳÿڵӽڵķߡedgeCounts[2 * i]ΪڵiߵĴ[2 * i + 1]ΪұߵĴ
+	struct EdgeCountVisitor
+	{
+		uint64_t* edgeCounts;
+
+		void OnEdge(uint32_t nodeIndex, bool left) { ++edgeCounts[2 * nodeIndex + (left ? 0 : 1)]; };
+		void OnIsolated(uint32_t, double) {};
+		EdgeCountVisitor Branch() const { return *this; };
+	};
+	}
+
+	// ָڵ㿪ʼһȡbaseDepthǸýڵ֮Ѿ߹ȡ
+	template <class Visitor>
+	double Forest::WalkTree(const uint64_t* values, const uint8_t* present, uint32_t nodeIndex, double baseDepth, Visitor visitor) const
+	{
+		return WalkNodes(m_nodes.data(), m_categoryTable.data(), values, present, nodeIndex, baseDepth, visitor);
+	}
+
+	// ڸĽڵ飨ɭֵĽڵһӳбռλڵʱת
+	template <class Visitor>
+	double Forest::WalkNodes(const PackedNode* nodes, const uint64_t* categoryTable, const uint64_t* values, const uint8_t* present, uint32_t nodeIndex, double baseDepth, Visitor visitor) const
+	{
+		double depth = (double)0.0;
+
+		while (true)
+		{
+			if (nodes[nodeIndex].IsLazy())
+			{
+				const LazySubtree& subtree = BuiltLazySubtree(nodes[nodeIndex].splitValue);
+				nodes = subtree.nodes.data();
+				categoryTable = subtree.categoryTable.data();
+				nodeIndex = 0;
+			}
+
+			const PackedNode& currentNode = nodes[nodeIndex];
+			uint32_t featureIndex = currentNode.FeatureIndex();
+
+			//ûеôߣѷƽһ
+			if (!present[featureIndex])
+			{
+				double leftDepth = depth;
+				double rightDepth = depth;
+				if (currentNode.LeftIsLeaf())
+				{
+					leftDepth += LeafDepth(present, currentNode.LeftLeafFeature(), baseDepth + depth, visitor.Branch());
+				}
+				else if (currentNode.HasLeft())
+				{
+					visitor.OnEdge(nodeIndex, true);
+					leftDepth += WalkNodes(nodes, categoryTable, values, present, nodeIndex + currentNode.LeftChildOffset(), baseDepth + depth, visitor.Branch());
+				}
+				if (currentNode.RightIsLeaf())
+				{
+					rightDepth += LeafDepth(present, currentNode.RightLeafFeature(), baseDepth + depth, visitor.Branch());
+				}
+				else if (currentNode.HasRight())
+				{
+					visitor.OnEdge(nodeIndex, false);
+					rightDepth += WalkNodes(nodes, categoryTable, values, present, nodeIndex + currentNode.RightChildOffset(), baseDepth + depth, visitor.Branch());
+				}
+				return (leftDepth + rightDepth) / (double)2.0;
+			}
+
+			++depth;
+			if (GoesLeft(currentNode, values[featureIndex], categoryTable))
+			{
+				if (currentNode.LeftIsLeaf())
+				{
+					depth += LeafDepth(present, currentNode.LeftLeafFeature(), baseDepth + depth, visitor);
+					break;
+				}
+				if (!currentNode.HasLeft())
+				{
+					visitor.OnIsolated(featureIndex, baseDepth + depth);
+					break;
+				}
+				visitor.OnEdge(nodeIndex, true);
+				nodeIndex += currentNode.LeftChildOffset();
+			}
+			else
+			{
+				if (currentNode.RightIsLeaf())
+				{
+					depth += LeafDepth(present, currentNode.RightLeafFeature(), baseDepth + depth, visitor);
+					break;
+				}
+				if (!currentNode.HasRight())
+				{
+					visitor.OnIsolated(featureIndex, baseDepth + depth);
+					break;
+				}
+				visitor.OnEdge(nodeIndex, false);
+				nodeIndex += currentNode.RightChildOffset();
+			}
+		}
+		return depth;
+	}
+
+	// ѹҶӣиʱȼһڴ˱룬Ȳ䡣
+	template <class Visitor>
+	double Forest::LeafDepth(const uint8_t* present, uint32_t featureIndex, double baseDepth, Visitor visitor) const
+	{
+		if (!present[featureIndex])
+		{
+			return (double)0.0;
+		}
+		visitor.OnIsolated(featureIndex, baseDepth + (double)1.0);
+		return (double)1.0;
+	}
+
+	void Forest::OptimizeLayout(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples)
+	{
+		if (m_treeRoots.size() == 0)
+		{
+			return;
+		}
+
+		// ߵļm_nodesеλü¼ȰӳŻС
+		BuildLazySubtrees();
+
+		size_t numColumns = featureNames.size();
+		size_t numFeatures = m_featureNames.size();
+
+		std::vector<uint8_t> present;
+		std::vector<size_t> columns;
+		std::vector<uint32_t> columnFeatures;
+		ResolveColumns(featureNames, present, columns, columnFeatures);
+
+		// ͳÿߵķʴ
+		std::vector<uint64_t> edgeCounts(2 * m_nodes.size(), 0);
+		EdgeCountVisitor visitor;
+		visitor.edgeCounts = edgeCounts.data();
+
+		std::vector<uint64_t> resolved(numFeatures, 0);
+		for (size_t row = 0; row < numSamples; ++row)
+		{
+			for (size_t i = 0; i < columns.size(); ++i)
+			{
+				resolved[columnFeatures[i]] = values[row * numColumns + columns[i]];
+			}
+			for (size_t tree = 0; tree < m_treeRoots.size(); ++tree)
+			{
+				WalkTree(resolved.data(), present.data(), m_treeRoots[tree], (double)0.0, visitor);
+			}
+		}
+
+		// ÿԭλţĽڵ䡣
+		PackedNodeList reordered;
+		for (size_t tree = 0; tree < m_treeRoots.size(); ++tree)
+		{
+			reordered.clear();
+			ReorderSubtree(m_nodes.data(), m_treeRoots[tree], edgeCounts, reordered);
+			std::copy(reordered.begin(), reordered.end(), m_nodes.begin() + m_treeRoots[tree]);
+		}
+	}
+
+	//дreorderedÿڵʴ϶ӽڵ֮
+	void Forest::ReorderSubtree(const PackedNode* nodes, uint32_t nodeIndex, const std::vector<uint64_t>& edgeCounts, PackedNodeList& reordered) const
+	{
+		const PackedNode& node = nodes[nodeIndex];
+		bool hasLeft = node.HasLeft() && !node.LeftIsLeaf();
+		bool hasRight = node.HasRight() && !node.RightIsLeaf();
+
+		size_t reorderedIndex = reordered.size();
+		PackedNode reorderedNode = node;
+		reorderedNode.featureAndFlags &= ~(uint32_t)PackedNode::FLAG_NEAR_RIGHT;
+		reordered.push_back(reorderedNode);
+
+		// ֻӽڵ㶼ʵʽڵʱҪѡĸڸڵ㡣
+		if (hasLeft && hasRight)
+		{
+			bool nearIsRight = edgeCounts[2 * nodeIndex + 1] > edgeCounts[2 * nodeIndex];
+			uint32_t nearIndex = nodeIndex + (nearIsRight ? node.RightChildOffset() : node.LeftChildOffset());
+			uint32_t farIndex = nodeIndex + (nearIsRight ? node.LeftChildOffset() : node.RightChildOffset());
+
+			ReorderSubtree(nodes, nearIndex, edgeCounts, reordered);
+			reordered[reorderedIndex].childOffset = (uint32_t)(reordered.size() - reorderedIndex);
+			if (nearIsRight)
+			{
+				reordered[reorderedIndex].featureAndFlags |= PackedNode::FLAG_NEAR_RIGHT;
+			}
+			ReorderSubtree(nodes, farIndex, edgeCounts, reordered);
+		}
+		else if (hasLeft)
+		{
+			ReorderSubtree(nodes, nodeIndex + node.LeftChildOffset(), edgeCounts, reordered);
+		}
+		else if (hasRight)
+		{
+			size_t rightIndex = reordered.size();
+			ReorderSubtree(nodes, nodeIndex + node.RightChildOffset(), edgeCounts, reordered);
+			if (!node.LeftIsLeaf())
+			{
+				reordered[reorderedIndex].childOffset = (uint32_t)(rightIndex - reorderedIndex);
+			}
+		}
+	}
+
+	// ݴָڵ㿪ʼ
+	double Forest::Score(const uint64_t* values, const uint8_t* present, uint32_t nodeIndex) const
+	{
+		return WalkTree(values, present, nodeIndex, (double)0.0, NullVisitor());
+	}
+
+	// ɭֶѽ֡
+	double Forest::ScoreResolved(const uint64_t* values, const uint8_t* present) const
+	{
+		double score = (double)0.0;
+
+		if (m_treeRoots.size() > 0)
+		{
+			std::vector<uint32_t>::const_iterator treeIter = m_treeRoots.begin();
+			while (treeIter != m_treeRoots.end())
+			{
+				score += Score(values, present, (*treeIter));
+				++treeIter;
+			}
+			score /= (double)m_treeRoots.size();
+		}
+		return score;
+	}
+
+	// ɭֵȡ
+	double Forest::Score(const Sample& sample) const
+	{
+		if (m_treeRoots.size() == 0)
+		{
+			return (double)0.0;
+		}
+
+		std::vector<uint64_t> values;
+		std::vector<uint8_t> present;
+		ResolveFeatures(sample, values, present);
+		return ScoreResolved(values.data(), present.data());
+	}
+
+	//ֵͬʱÿĹףֻһαcontributionsУ FeatureNames()
+	//ֵΪɸȥʱ 1/ ƽֵ
+	double Forest::Score(const Sample& sample, std::vector<double>& contributions) const
+	{
+		contributions.assign(m_featureNames.size(), (double)0.0);
+		if (m_treeRoots.size() == 0)
+		{
+			return (double)0.0;
+		}
+
+		std::vector<uint64_t> values;
+		std::vector<uint8_t> present;
+		ResolveFeatures(sample, values, present);
+
+		ContributionVisitor visitor;
+		visitor.contributions = contributions.data();
+		visitor.weight = (double)1.0;
+
+		double score = (double)0.0;
+		std::vector<uint32_t>::const_iterator treeIter = m_treeRoots.begin();
+		while (treeIter != m_treeRoots.end())
+		{
+			score += WalkTree(values.data(), present.data(), (*treeIter), (double)0.0, visitor);
+			++treeIter;
+		}
+
+		double numTrees = (double)m_treeRoots.size();
+		for (size_t i = 0; i < contributions.size(); ++i)
+		{
+			contributions[i] /= numTrees;
+		}
+		return score / numTrees;
+	}
+
+	//нһֵѵҪΪÿдSampleFeature
+	void Forest::AddSamples(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples)
+	{
+		size_t numColumns = featureNames.size();
+
+		// ͶӰ֮
+		std::vector<size_t> columns;
+		for (size_t column = 0; column < numColumns; ++column)
+		{
+			if (IsProjected(featureNames[column]))
+			{
+				columns.push_back(column);
+				AddColumn(featureNames[column], values + column, numSamples, numColumns);
+			}
+		}
+
+		size_t slot = 0;
+		for (size_t row = 0; row < numSamples && m_thresholdSampleRows > 0; ++row)
+		{
+			if (ReserveThresholdRow(slot))
+			{
+				for (size_t i = 0; i < columns.size(); ++i)
+				{
+					SparseFeature feature = { FeatureIndex(featureNames[columns[i]]), values[row * numColumns + columns[i]] };
+					m_thresholdRows[slot].second.push_back(feature);
+				}
+			}
+		}
+	}
+
+	void Forest::AddDataset(const ColumnarDataset& dataset)
+	{
+		// ͶӰ֮вȡӳļЩеҳ治ᱻʡ
+		std::vector<size_t> columns;
+		for (size_t column = 0; column < dataset.NumColumns(); ++column)
+		{
+			if (IsProjected(dataset.ColumnName(column)))
+			{
+				columns.push_back(column);
+				AddColumn(dataset.ColumnName(column), dataset.Column(column), dataset.NumRows(), 1);
+			}
+		}
+
+		size_t slot = 0;
+		for (size_t row = 0; row < dataset.NumRows() && m_thresholdSampleRows > 0; ++row)
+		{
+			if (ReserveThresholdRow(slot))
+			{
+				for (size_t i = 0; i < columns.size(); ++i)
+				{
+					SparseFeature feature = { FeatureIndex(dataset.ColumnName(columns[i])), dataset.Column(columns[i])[row] };
+					m_thresholdRows[slot].second.push_back(feature);
+				}
+			}
+		}
+	}
+
+	//һֵΨһֵϡȥغ˳ʾ룬ÿֵһҡ
+	void Forest::AddColumn(const std::string& featureName, const uint64_t* values, size_t numValues, size_t stride)
+	{
+		const size_t chunkSize = 1 << 20;
+
+		if (m_featureValues.count(featureName) == 0)
+		{
+			FeatureIndex(featureName);
+		}
+		Uint64Set& featureValueSet = m_featureValues[featureName];
+
+		std::vector<uint64_t> chunk;
+		chunk.reserve(std::min(numValues, chunkSize));
+		for (size_t start = 0; start < numValues; start += chunkSize)
+		{
+			size_t end = std::min(start + chunkSize, numValues);
+			chunk.clear();
+			for (size_t i = start; i < end; ++i)
+			{
+				chunk.push_back(values[i * stride]);
+			}
+			std::sort(chunk.begin(), chunk.end());
+			chunk.erase(std::unique(chunk.begin(), chunk.end()), chunk.end());
+
+			Uint64Set::iterator hint = featureValueSet.begin();
+			for (size_t i = 0; i < chunk.size(); ++i)
+			{
+				hint = featureValueSet.insert(hint, chunk[i]);
+				++hint;
+			}
+		}
+	}
+
+	ColumnarDataset::ColumnarDataset(size_t numRows) :
+		m_numRows(numRows),
+		m_mapping(NULL),
+		m_mappingSize(0)
+#ifdef _WIN32
+		, m_fileHandle(NULL),
+		m_mappingHandle(NULL)
+#endif
+	{
+	}
+
+	ColumnarDataset::~ColumnarDataset()
+	{
+		if (m_mapping)
+		{
+#ifdef _WIN32
+			UnmapViewOfFile(m_mapping);
+			CloseHandle((HANDLE)m_mappingHandle);
+			CloseHandle((HANDLE)m_fileHandle);
+#else
+			munmap(m_mapping, m_mappingSize);
+#endif
+		}
+	}
+
+	void ColumnarDataset::AddColumn(const std::string& name, const uint64_t* values)
+	{
+		m_names.push_back(name);
+		m_columns.push_back(values);
+	}
+
+	namespace
+	{
+		const char COLUMNAR_MAGIC[8] = { 'I', 'F', 'C', 'O', 'L', 'S', '0', '1' };
+
+		size_t AlignTo8(size_t size) { return (size + 7) & ~(size_t)7; };
+	}
+
+	ColumnarDataset* ColumnarDataset::Open(const std::string& path)
+	{
+		void* mapping = NULL;
+		size_t mappingSize = 0;
+
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return NULL;
+		}
+		LARGE_INTEGER fileSize;
+		HANDLE mappingHandle = NULL;
+		if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+		{
+			mappingHandle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		}
+		if (mappingHandle)
+		{
+			mapping = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+			mappingSize = (size_t)fileSize.QuadPart;
+		}
+		if (!mapping)
+		{
+			if (mappingHandle)
+			{
+				CloseHandle(mappingHandle);
+			}
+			CloseHandle(file);
+			return NULL;
+		}
+#else
+		int file = open(path.c_str(), O_RDONLY);
+		if (file < 0)
+		{
+			return NULL;
+		}
+		struct stat fileStat;
+		if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0)
+		{
+			mappingSize = (size_t)fileStat.st_size;
+			mapping = mmap(NULL, mappingSize, PROT_READ, MAP_SHARED, file, 0);
+			if (mapping == MAP_FAILED)
+			{
+				mapping = NULL;
+			}
+		}
+		close(file);
+		if (!mapping)
+		{
+			return NULL;
+		}
+#endif
+
+		// ļͷжļΧڡ
+		const char* bytes = (const char*)mapping;
+		uint64_t numColumns = 0;
+		uint64_t numRows = 0;
+		size_t offset = sizeof(COLUMNAR_MAGIC) + 2 * sizeof(uint64_t);
+		bool valid = mappingSize >= offset && memcmp(bytes, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC)) == 0;
+		if (valid)
+		{
+			memcpy(&numColumns, bytes + sizeof(COLUMNAR_MAGIC), sizeof(uint64_t));
+			memcpy(&numRows, bytes + sizeof(COLUMNAR_MAGIC) + sizeof(uint64_t), sizeof(uint64_t));
+		}
+
+		ColumnarDataset* dataset = new ColumnarDataset((size_t)numRows);
+		dataset->m_mapping = mapping;
+		dataset->m_mappingSize = mappingSize;
+#ifdef _WIN32
+		dataset->m_fileHandle = file;
+		dataset->m_mappingHandle = mappingHandle;
+#endif
+
+		for (uint64_t column = 0; valid && column < numColumns; ++column)
+		{
+			uint32_t nameLength = 0;
+			valid = offset + sizeof(uint32_t) <= mappingSize;
+			if (valid)
+			{
+				memcpy(&nameLength, bytes + offset, sizeof(uint32_t));
+				offset += sizeof(uint32_t);
+				valid = offset + nameLength <= mappingSize;
+			}
+			if (valid)
+			{
+				dataset->m_names.push_back(std::string(bytes + offset, nameLength));
+				offset += nameLength;
+			}
+		}
+
+		// óֽ
+		offset = AlignTo8(offset);
+		valid = valid && offset <= mappingSize && numRows <= (mappingSize / sizeof(uint64_t)) &&
+			numColumns <= (mappingSize - offset) / sizeof(uint64_t) / std::max(numRows, (uint64_t)1);
+		for (uint64_t column = 0; valid && column < numColumns; ++column)
+		{
+			dataset->m_columns.push_back((const uint64_t*)(bytes + offset + column * numRows * sizeof(uint64_t)));
+		}
+
+		if (!valid)
+		{
+			delete dataset;
+			return NULL;
+		}
+		return dataset;
+	}
+
+	bool ColumnarDataset::Write(const std::string& path, const ColumnarDataset& dataset)
+	{
+		std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+		if (!out.is_open())
+		{
+			return false;
+		}
+
+		uint64_t numColumns = dataset.NumColumns();
+		uint64_t numRows = dataset.NumRows();
+		out.write(COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+		out.write((const char*)&numColumns, sizeof(numColumns));
+		out.write((const char*)&numRows, sizeof(numRows));
+
+		size_t offset = sizeof(COLUMNAR_MAGIC) + 2 * sizeof(uint64_t);
+		for (size_t column = 0; column < dataset.NumColumns(); ++column)
+		{
+			const std::string& name = dataset.ColumnName(column);
+			uint32_t nameLength = (uint32_t)name.size();
+			out.write((const char*)&nameLength, sizeof(nameLength));
+			out.write(name.data(), nameLength);
+			offset += sizeof(nameLength) + nameLength;
+		}
+
+		const char padding[8] = { 0 };
+		out.write(padding, AlignTo8(offset) - offset);
+
+		for (size_t column = 0; column < dataset.NumColumns(); ++column)
+		{
+			out.write((const char*)dataset.Column(column), dataset.NumRows() * sizeof(uint64_t));
+		}
+		return out.good();
+	}
+
+	//㰴дŵľижӦֻһΡֻͬȡһѵебԡ
+	void Forest::ResolveColumns(const std::vector<std::string>& featureNames, std::vector<uint8_t>& present, std::vector<size_t>& columns, std::vector<uint32_t>& columnFeatures) const
+	{
+		present.assign(m_featureNames.size(), 0);
+		columns.clear();
+		columnFeatures.clear();
+
+		for (size_t column = 0; column < featureNames.size(); ++column)
+		{
+			FeatureNameToIndexMap::const_iterator indexIter = m_featureIndices.find(featureNames[column]);
+			if (indexIter != m_featureIndices.end() && !present[(*indexIter).second])
+			{
+				present[(*indexIter).second] = 1;
+				columns.push_back(column);
+				columnFeatures.push_back((*indexIter).second);
+			}
+		}
+	}
+
+	namespace
+	{
+		struct CacheSizes
+		{
+			size_t l1Bytes;
+			size_t l2Bytes;
+		};
+
+		// L1ݻL2ĴСⲻʱʹóĬֵ
+		CacheSizes DetectCacheSizes()
+		{
+			size_t l1Bytes = 32 * 1024;
+			size_t l2Bytes = 256 * 1024;
+
+#if defined(_WIN32)
+			DWORD length = 0;
+			GetLogicalProcessorInformation(NULL, &length);
+			std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+			if (!info.empty() && GetLogicalProcessorInformation(info.data(), &length))
+			{
+				for (size_t i = 0; i < info.size(); ++i)
+				{
+					if (info[i].Relationship == RelationCache && info[i].Cache.Level == 1 && info[i].Cache.Type != CacheInstruction)
+					{
+						l1Bytes = info[i].Cache.Size;
+					}
+					else if (info[i].Relationship == RelationCache && info[i].Cache.Level == 2)
+					{
+						l2Bytes = info[i].Cache.Size;
+					}
+				}
+			}
+#elif defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+			long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+			long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+			if (l1 > 0)
+			{
+				l1Bytes = (size_t)l1;
+			}
+			if (l2 > 0)
+			{
+				l2Bytes = (size_t)l2;
+			}
+#endif
+			CacheSizes sizes = { l1Bytes, l2Bytes };
+			return sizes;
+		}
+	}
+
+	void Forest::SetBatchSchedule(size_t treeBlockBytes, size_t samplesPerBlock)
+	{
+		m_treeBlockBytes = treeBlockBytes;
+		m_samplesPerBlock = samplesPerBlock;
+	}
+
+	//[firstTree, lastTree)еһѽ֣ۼӵdepthSums
+	void Forest::ScoreBlock(const uint64_t* resolved, const uint8_t* present, size_t numSamples, size_t firstTree, size_t lastTree, double* depthSums) const
+	{
+		size_t numFeatures = m_featureNames.size();
+
+		for (size_t sample = 0; sample < numSamples; ++sample)
+		{
+			const uint64_t* sampleValues = resolved + sample * numFeatures;
+			double depthSum = depthSums[sample];
+			for (size_t tree = firstTree; tree < lastTree; ++tree)
+			{
+				depthSum += Score(sampleValues, present, m_treeRoots[tree]);
+			}
+			depthSums[sample] = depthSum;
+		}
+	}
+
+	//ScoreBlockͬδÿͬʱƽm_interleaveα꣺ÿαǰһԤȡһڵ㣬
+	//Ȼֵһα꣬һαȴôʱα㡣ÿ԰˳ۼȣScoreBlockͬ
+	void Forest::ScoreBlockInterleaved(const uint64_t* resolved, const uint8_t* present, size_t numSamples, size_t firstTree, size_t lastTree, double* depthSums) const
+	{
+		const size_t maxCursors = 32;
+		size_t numFeatures = m_featureNames.size();
+		size_t groupSize = std::min(m_interleave, maxCursors);
+		const PackedNode* nodes = m_nodes.data();
+
+		uint32_t nodeIndices[maxCursors];
+		double depths[maxCursors];
+		bool done[maxCursors];
+
+		for (size_t tree = firstTree; tree < lastTree; ++tree)
+		{
+			for (size_t first = 0; first < numSamples; first += groupSize)
+			{
+				size_t numCursors = std::min(groupSize, numSamples - first);
+				for (size_t cursor = 0; cursor < numCursors; ++cursor)
+				{
+					nodeIndices[cursor] = m_treeRoots[tree];
+					depths[cursor] = (double)0.0;
+					done[cursor] = false;
+				}
+
+				size_t remaining = numCursors;
+				while (remaining > 0)
+				{
+					for (size_t cursor = 0; cursor < numCursors; ++cursor)
+					{
+						if (done[cursor])
+						{
+							continue;
+						}
+
+						const PackedNode& currentNode = nodes[nodeIndices[cursor]];
+						const uint64_t* sampleValues = resolved + (first + cursor) * numFeatures;
+						uint32_t featureIndex = currentNode.FeatureIndex();
+
+						// ȱʧҪ࣬ռλڵҪתӳWalkTreeɡ
+						if (currentNode.IsLazy() || !present[featureIndex])
+						{
+							depths[cursor] += WalkTree(sampleValues, present, nodeIndices[cursor], depths[cursor], NullVisitor());
+							done[cursor] = true;
+							--remaining;
+							continue;
+						}
+
+						++depths[cursor];
+						bool left = GoesLeft(currentNode, sampleValues[featureIndex]);
+						if (left ? currentNode.LeftIsLeaf() : currentNode.RightIsLeaf())
+						{
+							depths[cursor] += present[left ? currentNode.LeftLeafFeature() : currentNode.RightLeafFeature()] ? (double)1.0 : (double)0.0;
+							done[cursor] = true;
+							--remaining;
+						}
+						else if (!(left ? currentNode.HasLeft() : currentNode.HasRight()))
+						{
+							done[cursor] = true;
+							--remaining;
+						}
+						else
+						{
+							nodeIndices[cursor] += left ? currentNode.LeftChildOffset() : currentNode.RightChildOffset();
+							PREFETCH_NODE(nodes + nodeIndices[cursor]);
+						}
+					}
+				}
+
+				for (size_t cursor = 0; cursor < numCursors; ++cursor)
+				{
+					depthSums[first + cursor] += depths[cursor];
+				}
+			}
+		}
+	}
+
+	//԰дŵһ֣дscoresÿÿ֣
+	//ۼ˳ͬȫһ¡
+	void Forest::Score(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples, double* scores) const
+	{
+		if (m_treeRoots.size() == 0)
+		{
+			std::fill(scores, scores + numSamples, (double)0.0);
+			return;
+		}
+
+		size_t numColumns = featureNames.size();
+		size_t numFeatures = m_featureNames.size();
+
+		std::vector<uint8_t> present;
+		std::vector<size_t> columns;
+		std::vector<uint32_t> columnFeatures;
+		ResolveColumns(featureNames, present, columns, columnFeatures);
+
+		// ѡСռL2һ룬ֵۼռL1һ롣
+		static const CacheSizes cacheSizes = DetectCacheSizes();
+		size_t treeBlockBytes = m_treeBlockBytes ? m_treeBlockBytes : cacheSizes.l2Bytes / 2;
+		size_t samplesPerBlock = m_samplesPerBlock ? m_samplesPerBlock : std::max((cacheSizes.l1Bytes / 2) / ((numFeatures + 1) * sizeof(uint64_t)), (size_t)16);
+
+		// ڵֳֽ顣
+		std::vector<size_t> treeBlocks;
+		size_t blockStart = m_treeRoots[0];
+		treeBlocks.push_back(0);
+		for (size_t tree = 1; tree < m_treeRoots.size(); ++tree)
+		{
+			if ((m_treeRoots[tree] - blockStart) * sizeof(PackedNode) > treeBlockBytes)
+			{
+				treeBlocks.push_back(tree);
+				blockStart = m_treeRoots[tree];
+			}
+		}
+		treeBlocks.push_back(m_treeRoots.size());
+
+		std::vector<uint64_t> resolved(samplesPerBlock * numFeatures, 0);
+		std::vector<double> depthSums(samplesPerBlock);
+		for (size_t first = 0; first < numSamples; first += samplesPerBlock)
+		{
+			size_t blockSamples = std::min(samplesPerBlock, numSamples - first);
+			for (size_t sample = 0; sample < blockSamples; ++sample)
+			{
+				const uint64_t* rowValues = values + (first + sample) * numColumns;
+				uint64_t* sampleValues = resolved.data() + sample * numFeatures;
+				for (size_t i = 0; i < columns.size(); ++i)
+				{
+					sampleValues[columnFeatures[i]] = rowValues[columns[i]];
+				}
+			}
+
+			std::fill(depthSums.begin(), depthSums.end(), (double)0.0);
+			for (size_t block = 0; block + 1 < treeBlocks.size(); ++block)
+			{
+				if (m_interleave > 1)
+				{
+					ScoreBlockInterleaved(resolved.data(), present.data(), blockSamples, treeBlocks[block], treeBlocks[block + 1], depthSums.data());
+				}
+				else
+				{
+					ScoreBlock(resolved.data(), present.data(), blockSamples, treeBlocks[block], treeBlocks[block + 1], depthSums.data());
+				}
+			}
+
+			for (size_t sample = 0; sample < blockSamples; ++sample)
+			{
+				scores[first + sample] = depthSums[sample] / (double)m_treeRoots.size();
+			}
+		}
+	}
+
+	uint32_t Forest::RegisterFeature(const std::string& featureName)
+	{
+		return FeatureIndex(featureName);
+	}
+
+	bool Forest::FindFeature(const std::string& featureName, uint32_t& featureIndex) const
+	{
+		FeatureNameToIndexMap::const_iterator indexIter = m_featureIndices.find(featureName);
+		if (indexIter == m_featureIndices.end())
+		{
+			return false;
+		}
+		featureIndex = (*indexIter).second;
+		return true;
+	}
+
+	void Forest::AddSample(const SparseSample& sample)
+	{
+		size_t rowOffsets[2] = { 0, sample.size() };
+		AddSamples(rowOffsets, sample.data(), 1);
+	}
+
+	//һϡֵѵ (, ֵ) ȥغɶβ룬
+	//ûгֵκ״̬δעĺͶӰ֮ԣظֻȡһ
+	void Forest::AddSamples(const size_t* rowOffsets, const SparseFeature* features, size_t numSamples)
+	{
+		if (numSamples == 0)
+		{
+			return;
+		}
+
+		std::vector<std::pair<uint32_t, uint64_t> > pairs;
+		pairs.reserve(rowOffsets[numSamples] - rowOffsets[0]);
+		for (size_t row = 0; row < numSamples; ++row)
+		{
+			for (size_t i = rowOffsets[row]; i < rowOffsets[row + 1]; ++i)
+			{
+				uint32_t featureIndex = features[i].featureIndex;
+				if (featureIndex >= m_featureNames.size() || !m_projectedFeatures[featureIndex] || (i > rowOffsets[row] && featureIndex == features[i - 1].featureIndex))
+				{
+					continue;
+				}
+				pairs.push_back(std::make_pair(featureIndex, features[i].value));
+			}
+		}
+		m_sparseRows += numSamples;
+
+		size_t slot = 0;
+		for (size_t row = 0; row < numSamples && m_thresholdSampleRows > 0; ++row)
+		{
+			if (ReserveThresholdRow(slot))
+			{
+				m_thresholdRows[slot].first = true;
+				for (size_t i = rowOffsets[row]; i < rowOffsets[row + 1]; ++i)
+				{
+					if (features[i].featureIndex < m_featureNames.size() && m_projectedFeatures[features[i].featureIndex])
+					{
+						m_thresholdRows[slot].second.push_back(features[i]);
+					}
+				}
+			}
+		}
+
+		std::sort(pairs.begin(), pairs.end());
+		size_t runStart = 0;
+		while (runStart < pairs.size())
+		{
+			uint32_t featureIndex = pairs[runStart].first;
+			size_t runEnd = runStart;
+			while (runEnd < pairs.size() && pairs[runEnd].first == featureIndex)
+			{
+				++runEnd;
+			}
+
+			// ÿһֻһΣԶεĳȾг
+			if (m_sparseFeatureRows.size() <= featureIndex)
+			{
+				m_sparseFeatureRows.resize(featureIndex + 1, 0);
+			}
+			m_sparseFeatureRows[featureIndex] += runEnd - runStart;
+
+			Uint64Set& featureValueSet = m_featureValues[m_featureNames[featureIndex]];
+			Uint64Set::iterator hint = featureValueSet.begin();
+			for (size_t i = runStart; i < runEnd; ++i)
+			{
+				if (i == runStart || pairs[i].second != pairs[i - 1].second)
+				{
+					hint = featureValueSet.insert(hint, pairs[i].second);
+					++hint;
+				}
+			}
+			runStart = runEnd;
+		}
+	}
+
+	//ϡûгȡֵΪ0һ֪ûÿϡж֣Ͱ0Ψһֵϡ
+	void Forest::AddSparseDefaults()
+	{
+		if (m_sparseRows == 0)
+		{
+			return;
+		}
+
+		FeatureNameToValuesMap::iterator featureIter = m_featureValues.begin();
+		while (featureIter != m_featureValues.end())
+		{
+			uint32_t featureIndex = m_featureIndices.at((*featureIter).first);
+			uint64_t rows = featureIndex < m_sparseFeatureRows.size() ? m_sparseFeatureRows[featureIndex] : 0;
+			if (rows < m_sparseRows)
+			{
+				(*featureIter).second.insert(0);
+			}
+			++featureIter;
+		}
+	}
+
+	namespace
+	{
+		// ϡõֲ߳̾еֵ֮䱣ȫ0ȫΪ1Ĵڱ־
+		struct SparseScratch
+		{
+			std::vector<uint64_t> values;
+			std::vector<uint8_t> present;
+		};
+
+		SparseScratch& ThreadSparseScratch(size_t numFeatures)
+		{
+			static thread_local SparseScratch scratch;
+			if (scratch.values.size() < numFeatures)
+			{
+				scratch.values.resize(numFeatures, 0);
+				scratch.present.resize(numFeatures, 1);
+			}
+			return scratch;
+		}
+	}
+
+	//ϡֵдȫ0Ļֺֻ֣дλãÿĿ޹ء
+	double Forest::ScoreSparse(const SparseFeature* features, size_t numFeatures) const
+	{
+		SparseScratch& scratch = ThreadSparseScratch(m_featureNames.size());
+		uint64_t* values = scratch.values.data();
+
+		// д룬ظձһֵ
+		for (size_t i = numFeatures; i > 0; --i)
+		{
+			if (features[i - 1].featureIndex < m_featureNames.size())
+			{
+				values[features[i - 1].featureIndex] = features[i - 1].value;
+			}
+		}
+
+		double score = ScoreResolved(values, scratch.present.data());
+
+		for (size_t i = 0; i < numFeatures; ++i)
+		{
+			if (features[i].featureIndex < m_featureNames.size())
+			{
+				values[features[i].featureIndex] = 0;
+			}
+		}
+		return score;
+	}
+
+	double Forest::Score(const SparseSample& sample) const
+	{
+		if (m_treeRoots.size() == 0)
+		{
+			return (double)0.0;
+		}
+		return ScoreSparse(sample.data(), sample.size());
+	}
+
+	void Forest::Score(const size_t* rowOffsets, const SparseFeature* features, size_t numSamples, double* scores) const
+	{
+		if (m_treeRoots.size() == 0)
+		{
+			std::fill(scores, scores + numSamples, (double)0.0);
+			return;
+		}
+
+		for (size_t row = 0; row < numSamples; ++row)
+		{
+			scores[row] = ScoreSparse(features + rowOffsets[row], rowOffsets[row + 1] - rowOffsets[row]);
+		}
+	}
+
+	bool Forest::Merge(const Forest& other)
+	{
+		if (&other == this || !other.m_lazyTrees.empty())
+		{
+			return false;
+		}
+
+		// ڸתԷĽڵ㣬ȫɹ޸ıɭ֡
+		std::vector<uint32_t> featureMap(other.m_featureNames.size());
+		std::vector<std::string> newFeatures;
+		for (size_t i = 0; i < other.m_featureNames.size(); ++i)
+		{
+			FeatureNameToIndexMap::const_iterator indexIter = m_featureIndices.find(other.m_featureNames[i]);
+			if (indexIter != m_featureIndices.end())
+			{
+				featureMap[i] = (*indexIter).second;
+			}
+			else
+			{
+				featureMap[i] = (uint32_t)(m_featureNames.size() + newFeatures.size());
+				newFeatures.push_back(other.m_featureNames[i]);
+			}
+		}
+		if (m_featureNames.size() + newFeatures.size() > (size_t)PackedNode::FEATURE_INDEX_MASK + 1)
+		{
+			return false;
+		}
+
+		uint64_t categoryOffset = m_categoryTable.size();
+		PackedNodeList nodes(other.m_nodes);
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			PackedNode& node = nodes[i];
+			node.featureAndFlags = (node.featureAndFlags & ~(uint32_t)PackedNode::FEATURE_INDEX_MASK) | featureMap[node.FeatureIndex()];
+			if (node.LeftIsLeaf() && node.RightIsLeaf())
+			{
+				uint32_t leftFeature = featureMap[node.childOffset >> 16];
+				uint32_t rightFeature = featureMap[node.childOffset & 0xFFFF];
+				if (leftFeature > 0xFFFF || rightFeature > 0xFFFF)
+				{
+					return false;
+				}
+				node.childOffset = (leftFeature << 16) | rightFeature;
+			}
+			else if (node.LeftIsLeaf() || node.RightIsLeaf())
+			{
+				node.childOffset = featureMap[node.childOffset];
+			}
+			if (node.HasCategoryTable())
+			{
+				node.splitValue += categoryOffset;
+			}
+		}
+
+		for (size_t i = 0; i < newFeatures.size(); ++i)
+		{
+			FeatureIndex(newFeatures[i]);
+		}
+		uint32_t nodeOffset = (uint32_t)m_nodes.size();
+		m_nodes.insert(m_nodes.end(), nodes.begin(), nodes.end());
+		for (size_t tree = 0; tree < other.m_treeRoots.size(); ++tree)
+		{
+			m_treeRoots.push_back(nodeOffset + other.m_treeRoots[tree]);
+		}
+		m_categoryTable.insert(m_categoryTable.end(), other.m_categoryTable.begin(), other.m_categoryTable.end());
+		m_generation = NextGeneration();
+
+		// ˣñѵ¼ֵϲֻ׷еȻЧ
+		UpdateOutlierThreshold();
+		return true;
+	}
+
+	namespace
+	{
+		const char FOREST_MAGIC[8] = { 'I', 'F', 'T', 'R', 'E', 'E', 'S', '1' };
+
+		template <typename T>
+		bool ReadVector(std::ifstream& in, std::vector<T>& values)
+		{
+			uint64_t count = 0;
+			if (!in.read((char*)&count, sizeof(count)) || count > ((uint64_t)1 << 40) / sizeof(T))
+			{
+				return false;
+			}
+			values.resize((size_t)count);
+			return count == 0 || (bool)in.read((char*)values.data(), (std::streamsize)(count * sizeof(T)));
+		}
+
+		template <typename T>
+		void WriteVector(std::ofstream& out, const std::vector<T>& values)
+		{
+			uint64_t count = values.size();
+			out.write((const char*)&count, sizeof(count));
+			out.write((const char*)values.data(), (std::streamsize)(count * sizeof(T)));
+		}
+	}
+
+	//ļʽֽ򣩣8ֽħ"IFTREES1"uint64 ÿƣuint32  + ֽڣ
+	//ȻڵλͼÿΪ uint64  + 顣
+	bool Forest::Save(const std::string& path) const
+	{
+		if (!m_lazyTrees.empty())
+		{
+			return false;
+		}
+
+		std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+		if (!out.is_open())
+		{
+			return false;
+		}
+
+		uint64_t numFeatures = m_featureNames.size();
+		out.write(FOREST_MAGIC, sizeof(FOREST_MAGIC));
+		out.write((const char*)&numFeatures, sizeof(numFeatures));
+		for (size_t i = 0; i < m_featureNames.size(); ++i)
+		{
+			uint32_t nameLength = (uint32_t)m_featureNames[i].size();
+			out.write((const char*)&nameLength, sizeof(nameLength));
+			out.write(m_featureNames[i].data(), nameLength);
+		}
+		WriteVector(out, m_treeRoots);
+		WriteVector(out, m_nodes);
+		WriteVector(out, m_categoryTable);
+		return out.good();
+	}
+
+	bool Forest::Load(const std::string& path)
+	{
+		std::ifstream in(path.c_str(), std::ios::binary);
+		char magic[sizeof(FOREST_MAGIC)];
+		uint64_t numFeatures = 0;
+		if (!in.is_open() || !in.read(magic, sizeof(magic)) || memcmp(magic, FOREST_MAGIC, sizeof(magic)) != 0 ||
+			!in.read((char*)&numFeatures, sizeof(numFeatures)) || numFeatures > PackedNode::FEATURE_INDEX_MASK)
+		{
+			return false;
+		}
+
+		std::vector<std::string> featureNames;
+		for (uint64_t i = 0; i < numFeatures; ++i)
+		{
+			uint32_t nameLength = 0;
+			if (!in.read((char*)&nameLength, sizeof(nameLength)) || nameLength > (1 << 20))
+			{
+				return false;
+			}
+			std::string name(nameLength, '\0');
+			if (nameLength > 0 && !in.read(&name[0], nameLength))
+			{
+				return false;
+			}
+			featureNames.push_back(name);
+		}
+
+		std::vector<uint32_t> treeRoots;
+		PackedNodeList nodes;
+		std::vector<uint64_t> categoryTable;
+		if (!ReadVector(in, treeRoots) || !ReadVector(in, nodes) || !ReadVector(in, categoryTable))
+		{
+			return false;
+		}
+
+		// ڷΧڣ𻵵ļᵼԽʡÿռݴһ֮ǰĽڵ㣬
+		// ӽڵڸڵ֮ͬһڣκαķΧڽѭ
+		std::vector<uint32_t> sortedRoots(treeRoots);
+		std::sort(sortedRoots.begin(), sortedRoots.end());
+		if (!sortedRoots.empty() && sortedRoots.back() >= nodes.size())
+		{
+			return false;
+		}
+		size_t nextRoot = 0;
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			while (nextRoot < sortedRoots.size() && sortedRoots[nextRoot] <= i)
+			{
+				++nextRoot;
+			}
+			size_t treeEnd = (nextRoot < sortedRoots.size()) ? sortedRoots[nextRoot] : nodes.size();
+
+			const PackedNode& node = nodes[i];
+			bool valid = node.FeatureIndex() < numFeatures;
+			valid = valid && (!node.LeftIsLeaf() || node.LeftLeafFeature() < numFeatures);
+			valid = valid && (!node.RightIsLeaf() || node.RightLeafFeature() < numFeatures);
+			valid = valid && (!node.HasLeft() || node.LeftIsLeaf() || (node.LeftChildOffset() >= 1 && i + node.LeftChildOffset() < treeEnd));
+			valid = valid && (!node.HasRight() || node.RightIsLeaf() || (node.RightChildOffset() >= 1 && i + node.RightChildOffset() < treeEnd));
+			valid = valid && !node.IsLazy();
+			valid = valid && (!node.HasCategoryTable() || (node.splitValue < categoryTable.size() && categoryTable[node.splitValue] < categoryTable.size() - node.splitValue));
+			if (!valid)
+			{
+				return false;
+			}
+		}
+
+		m_featureValues.clear();
+		m_featureIndices.clear();
+		m_featureNames.clear();
+		m_projectedFeatures.clear();
+		m_categoricalFeatures.clear();
+		m_sparseRows = 0;
+		m_sparseFeatureRows.clear();
+		m_thresholdRows.clear();
+		m_thresholdRowsSeen = 0;
+		m_outlierThreshold = -HUGE_VAL;
+		m_referenceScores.clear();
+		for (size_t i = 0; i < featureNames.size(); ++i)
+		{
+			FeatureIndex(featureNames[i]);
+		}
+		m_treeRoots.swap(treeRoots);
+		m_nodes.swap(nodes);
+		m_categoryTable.swap(categoryTable);
+		m_lazyTrees.clear();
+		m_lazySubtrees.clear();
+		m_lazySnapshot.reset();
+		m_generation = NextGeneration();
+		return true;
+	}
+
+	void Forest::SetContamination(double contamination, size_t sampleRows)
+	{
+		m_contamination = std::min(std::max(contamination, (double)0.0), (double)1.0);
+		m_thresholdSampleRows = sampleRows;
+		m_thresholdRowsSeen = 0;
+		m_thresholdRows.clear();
+	}
+
+	//ˮسһµѵǷʱslotΪλãλգɵ
+	bool Forest::ReserveThresholdRow(size_t& slot)
+	{
+		if (m_thresholdSampleRows == 0)
+		{
+			return false;
+		}
+
+		++m_thresholdRowsSeen;
+		if (m_thresholdRows.size() < m_thresholdSampleRows)
+		{
+			slot = m_thresholdRows.size();
+			m_thresholdRows.push_back(std::make_pair(false, SparseSample()));
+			return true;
+		}
+
+		uint64_t index = m_thresholdRandom() % m_thresholdRowsSeen;
+		if (index >= m_thresholdSampleRows)
+		{
+			return false;
+		}
+		slot = (size_t)index;
+		m_thresholdRows[slot].first = false;
+		m_thresholdRows[slot].second.clear();
+		return true;
+	}
+
+	//Աѵ֣ΪοֲΪm_contaminationķΪֵ
+	void Forest::UpdateOutlierThreshold()
+	{
+		m_outlierThreshold = -HUGE_VAL;
+		m_referenceScores.clear();
+		if (m_thresholdRows.empty() || m_treeRoots.empty())
+		{
+			return;
+		}
+
+		size_t numFeatures = m_featureNames.size();
+		std::vector<uint64_t> values(numFeatures, 0);
+		std::vector<uint8_t> present(numFeatures, 0);
+		std::vector<double> scores;
+		scores.reserve(m_thresholdRows.size());
+		for (size_t i = 0; i < m_thresholdRows.size(); ++i)
+		{
+			const SparseSample& row = m_thresholdRows[i].second;
+			if (m_thresholdRows[i].first)
+			{
+				scores.push_back(ScoreSparse(row.data(), row.size()));
+				continue;
+			}
+
+			// ֻͬȡһ ResolveFeatures һ¡
+			for (size_t j = 0; j < row.size(); ++j)
+			{
+				if (!present[row[j].featureIndex])
+				{
+					values[row[j].featureIndex] = row[j].value;
+					present[row[j].featureIndex] = 1;
+				}
+			}
+			scores.push_back(ScoreResolved(values.data(), present.data()));
+			for (size_t j = 0; j < row.size(); ++j)
+			{
+				values[row[j].featureIndex] = 0;
+				present[row[j].featureIndex] = 0;
+			}
+		}
+
+		std::sort(scores.begin(), scores.end());
+		m_referenceScores.swap(scores);
+		if (m_contamination > (double)0.0)
+		{
+			size_t rank = std::min((size_t)(m_contamination * (double)m_referenceScores.size()), m_referenceScores.size() - 1);
+			m_outlierThreshold = m_referenceScores[rank];
+		}
+	}
+
+	bool Forest::IsOutlier(const Sample& sample) const
+	{
+		return m_treeRoots.size() > 0 && Score(sample) <= m_outlierThreshold;
+	}
+
+	bool Forest::IsOutlier(const SparseSample& sample) const
+	{
+		return m_treeRoots.size() > 0 && Score(sample) <= m_outlierThreshold;
+	}
+
+	void Forest::IsOutlier(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples, uint8_t* outliers) const
+	{
+		std::vector<double> scores(numSamples);
+		Score(featureNames, values, numSamples, scores.data());
+		for (size_t i = 0; i < numSamples; ++i)
+		{
+			outliers[i] = (m_treeRoots.size() > 0 && scores[i] <= m_outlierThreshold) ? 1 : 0;
+		}
+	}
+
+	void Forest::SetProjection(const std::vector<std::string>& featureNames)
+	{
+		m_projection = std::set<std::string>(featureNames.begin(), featureNames.end());
+		for (size_t i = 0; i < m_featureNames.size(); ++i)
+		{
+			m_projectedFeatures[i] = IsProjected(m_featureNames[i]) ? 1 : 0;
+		}
+	}
+
+	//ͳһνڵ㣨һһӳõѹҶӼϣռλڵת
+	void Forest::CountFeatureUsage(const PackedNode* nodes, size_t numNodes, uint32_t treeStamp, std::vector<FeatureUsage>& usage, std::vector<uint32_t>& treeStamps) const
+	{
+		for (size_t i = 0; i < numNodes; ++i)
+		{
+			const PackedNode& node = nodes[i];
+			if (node.IsLazy())
+			{
+				const LazySubtree& subtree = BuiltLazySubtree(node.splitValue);
+				CountFeatureUsage(subtree.nodes.data(), subtree.nodes.size(), treeStamp, usage, treeStamps);
+				continue;
+			}
+
+			uint32_t features[3];
+			size_t numFeatures = 0;
+			features[numFeatures++] = node.FeatureIndex();
+			if (node.IsLeaf())
+			{
+				++usage[node.FeatureIndex()].leafNodes;
+			}
+			else
+			{
+				++usage[node.FeatureIndex()].splitNodes;
+			}
+			if (node.LeftIsLeaf())
+			{
+				features[numFeatures++] = node.LeftLeafFeature();
+				++usage[node.LeftLeafFeature()].leafNodes;
+			}
+			if (node.RightIsLeaf())
+			{
+				features[numFeatures++] = node.RightLeafFeature();
+				++usage[node.RightLeafFeature()].leafNodes;
+			}
+
+			for (size_t j = 0; j < numFeatures; ++j)
+			{
+				if (treeStamps[features[j]] != treeStamp)
+				{
+					treeStamps[features[j]] = treeStamp;
+					++usage[features[j]].trees;
+				}
+			}
+		}
+	}
+
+	std::vector<FeatureUsage> Forest::FeatureUsageReport() const
+	{
+		std::vector<FeatureUsage> usage(m_featureNames.size());
+		for (size_t i = 0; i < m_featureNames.size(); ++i)
+		{
+			usage[i].name = m_featureNames[i];
+			usage[i].splitNodes = 0;
+			usage[i].leafNodes = 0;
+			usage[i].trees = 0;
+		}
+
+		// ÿĽڵţһĸΪֹ
+		std::vector<uint32_t> treeStamps(m_featureNames.size(), 0);
+		for (size_t tree = 0; tree < m_treeRoots.size(); ++tree)
+		{
+			size_t treeEnd = (tree + 1 < m_treeRoots.size()) ? m_treeRoots[tree + 1] : m_nodes.size();
+			CountFeatureUsage(m_nodes.data() + m_treeRoots[tree], treeEnd - m_treeRoots[tree], (uint32_t)(tree + 1), usage, treeStamps);
+		}
+		return usage;
+	}
+
+	std::vector<std::string> Forest::UsedFeatures() const
+	{
+		std::vector<FeatureUsage> usage = FeatureUsageReport();
+		std::vector<std::string> usedFeatures;
+		for (size_t i = 0; i < usage.size(); ++i)
+		{
+			if (usage[i].Used())
+			{
+				usedFeatures.push_back(usage[i].name);
+			}
+		}
+		return usedFeatures;
+	}
+
+	//ѵ״̬ռõڴ档ϺӳĽڵ㿪͵ĺʵֹ㡣
+	ForestMemoryUsage Forest::MemoryUsage() const
+	{
+		const size_t treeNodeOverhead = 4 * sizeof(void*);
+
+		ForestMemoryUsage usage;
+		usage.treeBytes = m_nodes.capacity() * sizeof(PackedNode) + m_treeRoots.capacity() * sizeof(uint32_t) + m_categoryTable.capacity() * sizeof(uint64_t);
+		usage.trainingBytes = m_featureNames.capacity() * sizeof(std::string);
+
+		FeatureNameToValuesMap::const_iterator featureIter = m_featureValues.begin();
+		while (featureIter != m_featureValues.end())
+		{
+			const std::string& featureName = (*featureIter).first;
+			size_t nameBytes = sizeof(std::string) + featureName.capacity();
+
+			usage.trainingBytes += treeNodeOverhead + nameBytes + sizeof(Uint64Set); // m_featureValues
+			usage.trainingBytes += treeNodeOverhead + nameBytes + sizeof(uint32_t); // m_featureIndices
+			usage.trainingBytes += featureName.capacity(); // m_featureNames
+			usage.trainingBytes += (*featureIter).second.size() * (treeNodeOverhead + sizeof(uint64_t));
+			++featureIter;
+		}
+		usage.trainingBytes += m_sparseFeatureRows.capacity() * sizeof(uint64_t);
+		usage.trainingBytes += m_categoricalFeatures.capacity();
+		usage.trainingBytes += m_projectedFeatures.capacity();
+		for (size_t i = 0; i < m_thresholdRows.size(); ++i)
+		{
+			usage.trainingBytes += sizeof(m_thresholdRows[i]) + m_thresholdRows[i].second.capacity() * sizeof(SparseFeature);
+		}
+		usage.trainingBytes += m_referenceScores.capacity() * sizeof(double);
+
+		// ӳѴĽڵ㣬Լδ¼ֵϺѵֵա
+		if (m_lazySnapshot)
+		{
+			for (size_t feature = 0; feature < m_lazySnapshot->values.size(); ++feature)
+			{
+				usage.trainingBytes += sizeof(std::string) + m_lazySnapshot->names[feature].capacity() + m_lazySnapshot->values[feature].capacity() * sizeof(uint64_t) + sizeof(uint32_t);
+			}
+			usage.trainingBytes += m_lazySnapshot->categorical.capacity();
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_lazyMutex);
+			for (size_t i = 0; i < m_lazySubtrees.size(); ++i)
+			{
+				const LazySubtree& subtree = *m_lazySubtrees[i];
+				usage.treeBytes += subtree.nodes.capacity() * sizeof(PackedNode) + subtree.categoryTable.capacity() * sizeof(uint64_t);
+				usage.trainingBytes += sizeof(LazySubtree) + subtree.ranges.capacity() * sizeof(ValueRange) + subtree.values.capacity() * sizeof(uint64_t);
+			}
+		}
+
+		// δϲĲɼ
+		for (size_t i = 0; i < m_ingestShards.size(); ++i)
+		{
+			IngestShard& shard = *m_ingestShards[i];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+
+			std::map<std::string, IngestBuffer>::const_iterator bufferIter = shard.buffers.begin();
+			while (bufferIter != shard.buffers.end())
+			{
+				usage.trainingBytes += treeNodeOverhead + sizeof(std::string) + (*bufferIter).first.capacity() + sizeof(IngestBuffer);
+				usage.trainingBytes += (*bufferIter).second.values.capacity() * sizeof(uint64_t);
+				++bufferIter;
+			}
+		}
+		return usage;
+	}
+
+	//ɭֵ
+	void Forest::Destroy()
+	{
+		m_nodes.clear();
+		m_treeRoots.clear();
+		m_categoryTable.clear();
+		m_lazyTrees.clear();
+		m_lazySubtrees.clear();
+		m_lazySnapshot.reset();
+	}
+
+	//ͷԶеĻ
+	void Forest::DestroyRandomizer()
+	{
+		if (m_randomizer)
+		{
+			delete m_randomizer;
+			m_randomizer = NULL;
+		}
+	}
+
+	DeltaScorer::DeltaScorer(const Forest& forest) :
+		m_forest(forest),
+		m_featureTreeEntries(0),
+		m_pathSteps(0),
+		m_updateStamp(0),
+		m_treesRewalked(0),
+		m_score((double)0.0)
+	{
+		// ·ֱӼ¼ m_nodes еλãܾӳռλڵ㡣
+		if (!forest.m_lazyTrees.empty())
+		{
+			throw std::invalid_argument("DeltaScorer: call Forest::BuildLazySubtrees() first");
+		}
+	}
+
+	double DeltaScorer::Reset(const Sample& sample)
+	{
+		m_forest.ResolveFeatures(sample, m_values, m_present);
+
+		size_t numTrees = m_forest.m_treeRoots.size();
+		m_paths.assign(numTrees, std::vector<PathStep>());
+		m_treeDepths.assign(numTrees, (double)0.0);
+		m_treeStamps.assign(numTrees, 0);
+		for (size_t tree = 0; tree < numTrees; ++tree)
+		{
+			PathStep root = { m_forest.m_treeRoots[tree], 0, (double)0.0 };
+			m_paths[tree].push_back(root);
+			WalkFrom(tree, 0);
+		}
+		m_treesRewalked = numTrees;
+
+		RebuildFeatureTrees();
+		SumDepths();
+		return m_score;
+	}
+
+	double DeltaScorer::Update(const std::string& featureName, uint64_t value)
+	{
+		uint32_t featureIndex = 0;
+		if (!m_forest.FindFeature(featureName, featureIndex))
+		{
+			m_treesRewalked = 0;
+			return m_score;
+		}
+		return Update(featureIndex, value);
+	}
+
+	double DeltaScorer::Update(uint32_t featureIndex, uint64_t value)
+	{
+		m_treesRewalked = 0;
+		if (featureIndex >= m_values.size())
+		{
+			return m_score;
+		}
+		m_values[featureIndex] = value;
+		m_present[featureIndex] = 1;
+
+		// ȡб±·ϵµǼǡ
+		std::vector<uint32_t> trees;
+		trees.swap(m_featureTrees[featureIndex]);
+		m_featureTreeEntries -= trees.size();
+		++m_updateStamp;
+
+		for (size_t i = 0; i < trees.size(); ++i)
+		{
+			uint32_t tree = trees[i];
+			if (m_treeStamps[tree] == m_updateStamp)
+			{
+				continue;
+			}
+			m_treeStamps[tree] = m_updateStamp;
+
+			// беѾڣֻ·иʱҪ±
+			const std::vector<PathStep>& path = m_paths[tree];
+			size_t step = 0;
+			while (step < path.size() && path[step].featureIndex != featureIndex)
+			{
+				++step;
+			}
+			if (step == path.size())
+			{
+				continue;
+			}
+
+			m_pathSteps -= path.size();
+			WalkFrom(tree, step);
+			m_pathSteps += m_paths[tree].size();
+			for (size_t j = step; j < m_paths[tree].size(); ++j)
+			{
+				m_featureTrees[m_paths[tree][j].featureIndex].push_back(tree);
+				++m_featureTreeEntries;
+			}
+			++m_treesRewalked;
+		}
+
+		// ڵЧ·ܲ3ʱؽбؽĿ̯Щڵϡ
+		if (m_featureTreeEntries > 4 * m_pathSteps + m_paths.size())
+		{
+			RebuildFeatureTrees();
+		}
+
+		SumDepths();
+		return m_score;
+	}
+
+	//·ĵstepڵĽڵ±һ滻һ֮·
+	// Forest::WalkTree ͬȱʧʱ WalkTree ƽ
+	void DeltaScorer::WalkFrom(size_t tree, size_t step)
+	{
+		std::vector<PathStep>& path = m_paths[tree];
+		uint32_t nodeIndex = path[step].nodeIndex;
+		double depth = path[step].depth;
+		path.resize(step);
+
+		const PackedNode* nodes = m_forest.m_nodes.data();
+		while (true)
+		{
+			const PackedNode& currentNode = nodes[nodeIndex];
+			uint32_t featureIndex = currentNode.FeatureIndex();
+			PathStep nodeStep = { nodeIndex, featureIndex, depth };
+			path.push_back(nodeStep);
+
+			if (!m_present[featureIndex])
+			{
+				AddBranchSteps(nodeIndex, nodeIndex, depth, path);
+				depth += m_forest.WalkTree(m_values.data(), m_present.data(), nodeIndex, depth, NullVisitor());
+				break;
+			}
+
+			++depth;
+			bool left = m_forest.GoesLeft(currentNode, m_values[featureIndex]);
+			bool childIsLeaf = left ? currentNode.LeftIsLeaf() : currentNode.RightIsLeaf();
+			if (childIsLeaf)
+			{
+				// ѹҶֻȡǷҶӵ±ʱӸڵ㿪ʼ
+				PathStep leafStep = { nodeIndex, left ? currentNode.LeftLeafFeature() : currentNode.RightLeafFeature(), nodeStep.depth };
+				path.push_back(leafStep);
+				depth += m_present[leafStep.featureIndex] ? (double)1.0 : (double)0.0;
+				break;
+			}
+			if (!(left ? currentNode.HasLeft() : currentNode.HasRight()))
+			{
+				break;
+			}
+			nodeIndex += left ? currentNode.LeftChildOffset() : currentNode.RightChildOffset();
+		}
+		m_treeDepths[tree] = depth;
+	}
+
+	//ȱʧƽᾭڵ㡣Щڵ㣨ѹҶӣΪӷֲڵ±Ĳ衣
+	void DeltaScorer::AddBranchSteps(uint32_t branchIndex, uint32_t nodeIndex, double branchDepth, std::vector<PathStep>& path) const
+	{
+		const PackedNode& currentNode = m_forest.m_nodes[nodeIndex];
+		uint32_t featureIndex = currentNode.FeatureIndex();
+		if (nodeIndex != branchIndex)
+		{
+			PathStep nodeStep = { branchIndex, featureIndex, branchDepth };
+			path.push_back(nodeStep);
+		}
+
+		bool present = m_present[featureIndex] != 0;
+		bool left = present && m_forest.GoesLeft(currentNode, m_values[featureIndex]);
+		for (int side = 0; side < 2; ++side)
+		{
+			bool isLeft = (side == 0);
+			if (present && isLeft != left)
+			{
+				continue;
+			}
+			if (isLeft ? currentNode.LeftIsLeaf() : currentNode.RightIsLeaf())
+			{
+				PathStep leafStep = { branchIndex, isLeft ? currentNode.LeftLeafFeature() : currentNode.RightLeafFeature(), branchDepth };
+				path.push_back(leafStep);
+			}
+			else if (isLeft ? currentNode.HasLeft() : currentNode.HasRight())
+			{
+				AddBranchSteps(branchIndex, nodeIndex + (isLeft ? currentNode.LeftChildOffset() : currentNode.RightChildOffset()), branchDepth, path);
+			}
+		}
+	}
+
+	void DeltaScorer::RebuildFeatureTrees()
 	{
+		m_featureTrees.assign(m_values.size(), std::vector<uint32_t>());
+		m_featureTreeEntries = 0;
+		m_pathSteps = 0;
+		for (size_t tree = 0; tree < m_paths.size(); ++tree)
+		{
+			for (size_t step = 0; step < m_paths[tree].size(); ++step)
+			{
+				m_featureTrees[m_paths[tree][step].featureIndex].push_back((uint32_t)tree);
+				++m_featureTreeEntries;
+			}
+			m_pathSteps += m_paths[tree].size();
+		}
 	}
 
-	Node::Node(const std::string& featureName, uint64_t splitValue) :
-		m_featureName(featureName),
-		m_splitValue(splitValue),
-		m_left(NULL),
-		m_right(NULL)
+	//˳ͣ Forest::Score ۼ˳ͬ
+	void DeltaScorer::SumDepths()
 	{
+		m_score = (double)0.0;
+		if (m_treeDepths.size() > 0)
+		{
+			for (size_t tree = 0; tree < m_treeDepths.size(); ++tree)
+			{
+				m_score += m_treeDepths[tree];
+			}
+			m_score /= (double)m_treeDepths.size();
+		}
 	}
 
-	Node::~Node()
+	namespace
+	{
+	// ̻߳ľա
+	struct HandleSnapshot
+	{
+		uint64_t handleId; // 0ʾûп
+		uint64_t version;
+		ForestConstPtr forest;
+	};
+
+	uint64_t NextHandleId()
 	{
-		DestroyLeftSubtree();
-		DestroyRightSubtree();
+		static std::atomic<uint64_t> nextHandleId(1);
+		return nextHandleId++;
+	}
 	}
 
-	void Node::SetLeftSubTree(Node* subtree)
+	ForestHandle::ForestHandle() :
+		m_id(NextHandleId()),
+		m_version(0)
 	{
-		DestroyLeftSubtree();
-		m_left = subtree;
 	}
 
-	void Node::SetRightSubTree(Node* subtree)
+	ForestHandle::ForestHandle(ForestConstPtr forest) :
+		m_id(NextHandleId()),
+		m_forest(forest),
+		m_version(forest ? 1 : 0)
 	{
-		DestroyRightSubtree();
-		m_right = subtree;
 	}
 
-	void Node::DestroyLeftSubtree()
+	//ر߳̿еɭ֣չʱʱڸصָڱ߳һʹκξ֮ǰЧ
+	const Forest* ForestHandle::Current() const
 	{
-		if (m_left)
+		static thread_local HandleSnapshot snapshot = { 0, 0, ForestConstPtr() };
+
+		uint64_t version = m_version.load(std::memory_order_acquire);
+		if (snapshot.handleId != m_id || snapshot.version != version)
 		{
-			delete m_left;
-			m_left = NULL;
+			std::lock_guard<std::mutex> lock(m_publishMutex);
+			snapshot.handleId = m_id;
+			snapshot.version = m_version.load(std::memory_order_relaxed);
+			snapshot.forest = m_forest;
 		}
+		return snapshot.forest.get();
 	}
 
-	void Node::DestroyRightSubtree()
+	//صǰɭֵĹȨҪھ֮ɭʱʹãֲҪ
+	ForestConstPtr ForestHandle::Acquire() const
 	{
-		if (m_right)
+		std::lock_guard<std::mutex> lock(m_publishMutex);
+		return m_forest;
+	}
+
+	//滻ǰɭֲµİ汾šʹþɭֵĶ߲Ӱ죬һʱɭ֡
+	uint64_t ForestHandle::Publish(ForestConstPtr forest)
+	{
+		ForestConstPtr previous;
+		uint64_t version = 0;
 		{
-			delete m_right;
-			m_right = NULL;
+			std::lock_guard<std::mutex> lock(m_publishMutex);
+			previous.swap(m_forest);
+			m_forest = forest;
+			version = m_version.load(std::memory_order_relaxed) + 1;
+			m_version.store(version, std::memory_order_release);
 		}
+
+		// û̻߳ɭ֣⣩ͷš
+		previous.reset();
+		return version;
 	}
 
-	Forest::Forest() :
-		m_randomizer(new Randomizer()),
-		m_numTreesToCreate(10),
-		m_subSamplingSize(0)
+	double ForestHandle::Score(const Sample& sample) const
 	{
+		const Forest* forest = Current();
+		return forest ? forest->Score(sample) : (double)0.0;
 	}
 
-	Forest::Forest(uint32_t numTrees, uint32_t subSamplingSize) :
-		m_randomizer(new Randomizer()),
-		m_numTreesToCreate(numTrees),
-		m_subSamplingSize(subSamplingSize)
+	void ForestHandle::Score(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples, double* scores) const
 	{
+		const Forest* forest = Current();
+		if (forest)
+		{
+			forest->Score(featureNames, values, numSamples, scores);
+		}
+		else
+		{
+			std::fill(scores, scores + numSamples, (double)0.0);
+		}
 	}
 
-	Forest::~Forest()
+	ScoreCache::ScoreCache(const std::vector<std::string>& featureNames, size_t capacity) :
+		m_featureNames(featureNames),
+		m_numSets(std::max((capacity + WAYS - 1) / WAYS, (size_t)1)),
+		m_hits(0),
+		m_misses(0),
+		m_evictions(0)
 	{
-		DestroyRandomizer();
-		Destroy();
+		Entry emptyEntry = { 0, 0, (double)0.0 };
+		m_entries.assign(m_numSets * WAYS, emptyEntry);
+		m_keys.assign(m_entries.size() * m_featureNames.size(), 0);
+		m_nextVictims.assign(m_numSets, 0);
 	}
 
-	void Forest::SetRandomizer(Randomizer* newRandomizer)
+	uint64_t ScoreCache::Hash(const uint64_t* values) const
 	{
-		DestroyRandomizer();
-		m_randomizer = newRandomizer;
+		uint64_t hash = 0x9E3779B97F4A7C15ULL;
+		for (size_t i = 0; i < m_featureNames.size(); ++i)
+		{
+			hash = (hash ^ values[i]) * 0xBF58476D1CE4E5B9ULL;
+			hash ^= hash >> 31;
+		}
+		return hash;
 	}
 
-	//ÿӵ֪бС
-	//ӦΨһֵ
-	void Forest::AddSample(const Sample& sample)
+	bool ScoreCache::Find(uint64_t generation, uint64_t hash, const uint64_t* values, double& score)
 	{
-        // ֱӴ洢ֻ
-		const FeaturePtrList& features = sample.Features();
-		FeaturePtrList::const_iterator featureIter = features.begin();
-		while (featureIter != features.end())
+		size_t numColumns = m_featureNames.size();
+		size_t set = (size_t)(hash % m_numSets);
+		std::lock_guard<std::mutex> lock(m_locks[set % NUM_LOCKS]);
+
+		for (size_t way = 0; way < WAYS; ++way)
 		{
-			const FeaturePtr feature = (*featureIter);
-			const std::string& featureName = feature->Name();
-			uint64_t featureValue = feature->Value();
+			size_t entryIndex = set * WAYS + way;
+			const Entry& entry = m_entries[entryIndex];
+			if (entry.generation == generation && entry.hash == hash && std::equal(values, values + numColumns, m_keys.begin() + entryIndex * numColumns))
+			{
+				score = entry.score;
+				return true;
+			}
+		}
+		return false;
+	}
 
-			// ֵ
-			if (m_featureValues.count(featureName) == 0)
+	//һʹÿյĻھģ͵滻ڵ
+	void ScoreCache::Insert(uint64_t generation, uint64_t hash, const uint64_t* values, double score)
+	{
+		size_t numColumns = m_featureNames.size();
+		size_t set = (size_t)(hash % m_numSets);
+		std::lock_guard<std::mutex> lock(m_locks[set % NUM_LOCKS]);
+
+		size_t victim = WAYS;
+		for (size_t way = 0; way < WAYS && victim == WAYS; ++way)
+		{
+			const Entry& entry = m_entries[set * WAYS + way];
+			if (entry.generation != generation)
 			{
-				Uint64Set featureValueSet;
-				featureValueSet.insert(featureValue);
-				m_featureValues.insert(std::make_pair(featureName, featureValueSet));
+				victim = way;
 			}
-			else
+			else if (entry.hash == hash && std::equal(values, values + numColumns, m_keys.begin() + (set * WAYS + way) * numColumns))
 			{
-				Uint64Set& featureValueSet = m_featureValues.at(featureName);
-				featureValueSet.insert(featureValue);
+				return; // ߳Ѿ
 			}
-
-			++featureIter;
 		}
+		if (victim == WAYS)
+		{
+			victim = m_nextVictims[set];
+			m_nextVictims[set] = (uint8_t)((victim + 1) % WAYS);
+			++m_evictions;
+		}
+
+		size_t entryIndex = set * WAYS + victim;
+		m_entries[entryIndex].hash = hash;
+		m_entries[entryIndex].generation = generation;
+		m_entries[entryIndex].score = score;
+		std::copy(values, values + numColumns, m_keys.begin() + entryIndex * numColumns);
 	}
 
+	double ScoreCache::Score(const Forest& forest, const uint64_t* values)
+	{
+		double score = (double)0.0;
+		Score(forest, values, 1, &score);
+		return score;
+	}
 
-	//ͷصΪǵݹ麯
-	//ָʾݹĵǰȡ
-	NodePtr Forest::CreateTree(const FeatureNameToValuesMap& featureValues, size_t depth)
+	//԰дŵһ֡еֱӷأδеһֺ뻺档
+	void ScoreCache::Score(const Forest& forest, const uint64_t* values, size_t numSamples, double* scores)
 	{
-		// Sanity check.
-		if (featureValues.size() <= 1)
+		size_t numColumns = m_featureNames.size();
+		uint64_t generation = forest.Generation();
+
+		std::vector<size_t> missRows;
+		std::vector<uint64_t> missHashes;
+		for (size_t row = 0; row < numSamples; ++row)
 		{
-			return NULL;
+			const uint64_t* rowValues = values + row * numColumns;
+			uint64_t hash = Hash(rowValues);
+			if (!Find(generation, hash, rowValues, scores[row]))
+			{
+				missRows.push_back(row);
+				missHashes.push_back(hash);
+			}
 		}
-
-		// ȣֹͣ
-		if ((m_subSamplingSize > 0) && (depth >= m_subSamplingSize))
+		m_hits += numSamples - missRows.size();
+		m_misses += missRows.size();
+		if (missRows.empty())
 		{
-			return NULL;
+			return;
 		}
 
-		// ѡһ
-		size_t selectedFeatureIndex = (size_t)m_randomizer->RandUInt64(0, featureValues.size() - 1);
-		FeatureNameToValuesMap::const_iterator featureIter = featureValues.begin();
-		std::advance(featureIter, selectedFeatureIndex);
-		const std::string& selectedFeatureName = (*featureIter).first;
-
-		// ȡֵбв֡
-		const Uint64Set& featureValueSet = (*featureIter).second;
-		if (featureValueSet.size() == 0)
+		std::vector<uint64_t> missValues(missRows.size() * numColumns);
+		for (size_t i = 0; i < missRows.size(); ++i)
 		{
-			return NULL;
+			std::copy(values + missRows[i] * numColumns, values + (missRows[i] + 1) * numColumns, missValues.begin() + i * numColumns);
 		}
+		std::vector<double> missScores(missRows.size());
+		forest.Score(m_featureNames, missValues.data(), missRows.size(), missScores.data());
 
-		// ѡһֵ.
-		size_t splitValueIndex = 0;
-		if (featureValueSet.size() > 1)
+		for (size_t i = 0; i < missRows.size(); ++i)
 		{
-			splitValueIndex = (size_t)m_randomizer->RandUInt64(0, featureValueSet.size() - 1);
+			scores[missRows[i]] = missScores[i];
+			Insert(generation, missHashes[i], missValues.data() + i * numColumns, missScores[i]);
 		}
-		Uint64Set::const_iterator splitValueIter = featureValueSet.begin();
-		std::advance(splitValueIter, splitValueIndex);
-		uint64_t splitValue = (*splitValueIter);
+	}
 
-		// ڵֵ
-		NodePtr tree = new Node(selectedFeatureName, splitValue);
-		if (tree)
+	void ScoreCache::Score(const ForestHandle& handle, const uint64_t* values, size_t numSamples, double* scores)
+	{
+		const Forest* forest = handle.Current();
+		if (forest)
 		{
+			Score(*forest, values, numSamples, scores);
+		}
+		else
+		{
+			std::fill(scores, scores + numSamples, (double)0.0);
+		}
+	}
 
-			//ղʹõֵ汾һұһá
-
-			FeatureNameToValuesMap tempFeatureValues = featureValues;
+	void ScoreCache::Clear()
+	{
+		for (size_t set = 0; set < m_numSets; ++set)
+		{
+			std::lock_guard<std::mutex> lock(m_locks[set % NUM_LOCKS]);
+			for (size_t way = 0; way < WAYS; ++way)
+			{
+				m_entries[set * WAYS + way].generation = 0;
+			}
+		}
+	}
 
-			// 
-			Uint64Set leftFeatureValueSet = featureValueSet;
-			splitValueIter = leftFeatureValueSet.begin();
-			std::advance(splitValueIter, splitValueIndex);
-			leftFeatureValueSet.erase(splitValueIter, leftFeatureValueSet.end());
-			tempFeatureValues[selectedFeatureName] = leftFeatureValueSet;
-			tree->SetLeftSubTree(CreateTree(tempFeatureValues, depth + 1));
+	ScoreCacheStats ScoreCache::Stats() const
+	{
+		ScoreCacheStats stats = { m_hits.load(), m_misses.load(), m_evictions.load() };
+		return stats;
+	}
 
-			// 
-			if (splitValueIndex < featureValueSet.size() - 1)
+	namespace
+	{
+		// ǰ߳ʹõCPUţѾ̵׺cpusetƣֻ֧ʧʱΪա
+		std::vector<size_t> AllowedCpus()
+		{
+			std::vector<size_t> allowed;
+#if defined(_WIN32)
+			DWORD_PTR processMask = 0;
+			DWORD_PTR systemMask = 0;
+			if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+			{
+				for (size_t cpu = 0; cpu < sizeof(DWORD_PTR) * 8; ++cpu)
+				{
+					if (processMask & ((DWORD_PTR)1 << cpu))
+					{
+						allowed.push_back(cpu);
+					}
+				}
+			}
+#elif defined(__linux__)
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
 			{
-				Uint64Set rightFeatureValueSet = featureValueSet;
-				splitValueIter = rightFeatureValueSet.begin();
-				std::advance(splitValueIter, splitValueIndex + 1);
-				rightFeatureValueSet.erase(rightFeatureValueSet.begin(), splitValueIter);
-				tempFeatureValues[selectedFeatureName] = rightFeatureValueSet;
-				tree->SetRightSubTree(CreateTree(tempFeatureValues, depth + 1));
+				for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+				{
+					if (CPU_ISSET(cpu, &cpus))
+					{
+						allowed.push_back(cpu);
+					}
+				}
 			}
+#endif
+			return allowed;
 		}
 
-		return tree;
+		// ѵǰ̶̹߳һCPUϣֻ֧ʧʱԡ
+		void PinCurrentThread(size_t cpu)
+		{
+#if defined(_WIN32)
+			SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#elif defined(__linux__)
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(cpu, &cpus);
+			pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+			(void)cpu;
+#endif
+		}
 	}
 
-	//ָ캯֡
-	void Forest::Create()
+	ParallelScorer::ParallelScorer(const Forest& forest, size_t numThreads, bool pinThreads) :
+		m_forest(forest),
+		m_sampleValues(NULL),
+		m_samplePresent(NULL),
+		m_epoch(0),
+		m_done(0),
+		m_parked(0),
+		m_stop(false)
 	{
-		m_trees.reserve(m_numTreesToCreate);
+		size_t numTrees = forest.m_treeRoots.size();
+		numThreads = std::max(std::min(numThreads, numTrees), (size_t)1);
+		for (size_t range = 0; range <= numThreads; ++range)
+		{
+			m_treeRanges.push_back(numTrees * range / numThreads);
+		}
+		m_depths.resize(numTrees);
+		m_allPresent.assign(forest.m_featureNames.size(), 1);
 
-		for (size_t i = 0; i < m_numTreesToCreate; ++i)
+		// iεĹ̶̹߳CPUеĵiϣ̶߳CPUʱƣ̶̲߳
+		// һCPUûй̶̣߳߳CPU
+		std::vector<size_t> allowed;
+		if (pinThreads)
 		{
-			NodePtr tree = CreateTree(m_featureValues, 0);
-			if (tree)
-			{
-				m_trees.push_back(tree);
-			}
+			allowed = AllowedCpus();
+		}
+		for (size_t range = 1; range < numThreads; ++range)
+		{
+			bool pin = !allowed.empty();
+			size_t cpu = pin ? allowed[range % allowed.size()] : 0;
+			m_workers.push_back(std::thread(&ParallelScorer::WorkerLoop, this, range, pin, cpu));
+		}
+	}
+
+	ParallelScorer::~ParallelScorer()
+	{
+		m_stop.store(true, std::memory_order_release);
+		m_epoch.fetch_add(1);
+		WakeParked();
+		for (size_t i = 0; i < m_workers.size(); ++i)
+		{
+			m_workers[i].join();
 		}
 	}
 
+	void ParallelScorer::ScoreRange(size_t range)
+	{
+		for (size_t tree = m_treeRanges[range]; tree < m_treeRanges[range + 1]; ++tree)
+		{
+			m_depths[tree] = m_forest.Score(m_sampleValues, m_samplePresent, m_forest.m_treeRoots[tree]);
+		}
+	}
 
-	// ָ
-	double Forest::Score(const Sample& sample, const NodePtr tree)
+	//ϵȴĹ̡߳m_epoch Ѿӣm_parked ˳һµĴʣ
+	//Ի￴ȴ̣߳߸߳ڵȴǰµš
+	void ParallelScorer::WakeParked()
 	{
-		double depth = (double)0.0;
+		if (m_parked.load() > 0)
+		{
+			std::lock_guard<std::mutex> lock(m_parkMutex);
+			m_wake.notify_all();
+		}
+	}
 
-		const FeaturePtrList& features = sample.Features();
+	//̣߳ȴű仯ԼһһʱûµĹϵȴռCPU
+	void ParallelScorer::WorkerLoop(size_t range, bool pinThread, size_t cpu)
+	{
+		const size_t maxSpins = 1 << 16;
 
-		NodePtr currentNode = tree;
-		while (currentNode)
+		if (pinThread)
 		{
-			bool foundFeature = false;
+			PinCurrentThread(cpu);
+		}
 
-			// ҵһ
-			FeaturePtrList::const_iterator featureIter = features.begin();
-			while (featureIter != features.end() && !foundFeature)
+		uint64_t seenEpoch = 0;
+		while (true)
+		{
+			uint64_t epoch = 0;
+			for (size_t spins = 0; (epoch = m_epoch.load(std::memory_order_acquire)) == seenEpoch; ++spins)
 			{
-				const FeaturePtr currentFeature = (*featureIter);
-				if (currentFeature->Name().compare(currentNode->FeatureName()) == 0)
+				if (spins < maxSpins)
 				{
-					if (currentFeature->Value() < currentNode->SplitValue())
-					{
-						currentNode = currentNode->Left();
-					}
-					else
-					{
-						currentNode = currentNode->Right();
-					}
-					++depth;
-					foundFeature = true;
+					SPIN_PAUSE();
+					continue;
 				}
-				++featureIter;
+
+				std::unique_lock<std::mutex> lock(m_parkMutex);
+				m_parked.fetch_add(1);
+				while ((epoch = m_epoch.load()) == seenEpoch)
+				{
+					m_wake.wait(lock);
+				}
+				m_parked.fetch_sub(1);
+				break;
 			}
+			seenEpoch = epoch;
 
-			//ûеôߣѷƽһ
-			if (!foundFeature)
+			if (m_stop.load(std::memory_order_acquire))
 			{
-				double leftDepth = depth + Score(sample, currentNode->Left());
-				double rightDepth = depth + Score(sample, currentNode->Right());
-				return (leftDepth + rightDepth) / (double)2.0;
+				return;
 			}
+			ScoreRange(range);
+			m_done.fetch_add(1, std::memory_order_release);
 		}
-		return depth;
 	}
 
-	// ɭֵȡ
-	double Forest::Score(const Sample& sample)
+	double ParallelScorer::ScoreResolved(const uint64_t* values, const uint8_t* present)
 	{
+		const size_t maxSpins = 1 << 16;
+
+		if (m_depths.empty())
+		{
+			return (double)0.0;
+		}
+
+		m_sampleValues = values;
+		m_samplePresent = present;
+		m_done.store(0, std::memory_order_relaxed);
+		m_epoch.fetch_add(1);
+		WakeParked();
+
+		// ߳ûаʱɣ̶߳ڿеCPUʱóCPU
+		ScoreRange(0);
+		for (size_t spins = 0; m_done.load(std::memory_order_acquire) < m_workers.size(); ++spins)
+		{
+			if (spins < maxSpins)
+			{
+				SPIN_PAUSE();
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		//  Forest::ScoreResolved ͬ˳
 		double score = (double)0.0;
-		
-		if (m_trees.size() > 0)
+		for (size_t tree = 0; tree < m_depths.size(); ++tree)
+		{
+			score += m_depths[tree];
+		}
+		return score / (double)m_depths.size();
+	}
+
+	double ParallelScorer::Score(const Sample& sample)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_forest.ResolveFeatures(sample, m_values, m_present);
+		return ScoreResolved(m_values.data(), m_present.data());
+	}
+
+	double ParallelScorer::Score(const uint64_t* values)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return ScoreResolved(values, m_allPresent.data());
+	}
+
+	DriftMonitor::DriftMonitor(const std::vector<double>& referenceScores, size_t numBins, size_t windowSize, double threshold) :
+		m_window(std::max(windowSize, (size_t)1), 0),
+		m_next(0),
+		m_filled(0),
+		m_divergence((double)0.0),
+		m_threshold(threshold),
+		m_drifted(false)
+	{
+		std::vector<double> sorted(referenceScores);
+		std::sort(sorted.begin(), sorted.end());
+
+		// ߽ȡοĵȼλظı߽ϲnumBins
+		numBins = std::max(numBins, (size_t)1);
+		for (size_t bin = 1; bin < numBins && sorted.size() > 0; ++bin)
 		{
-			NodePtrList::const_iterator treeIter = m_trees.begin();
-			while (treeIter != m_trees.end())
+			double edge = sorted[bin * sorted.size() / numBins];
+			if (m_edges.empty() || edge > m_edges.back())
 			{
-				score += (double)Score(sample, (*treeIter));
-				++treeIter;
+				m_edges.push_back(edge);
 			}
-			score /= (double)m_trees.size();
 		}
-		return score;
+
+		size_t numEdges = m_edges.size();
+		std::vector<size_t> referenceCounts(numEdges + 1, 0);
+		for (size_t i = 0; i < sorted.size(); ++i)
+		{
+			++referenceCounts[Bin(sorted[i])];
+		}
+		for (size_t bin = 0; bin <= numEdges; ++bin)
+		{
+			m_referenceFractions.push_back(((double)referenceCounts[bin] + (double)0.5) / ((double)sorted.size() + (double)0.5 * (double)(numEdges + 1)));
+		}
+
+		m_counts.assign(numEdges + 1, 0);
+		m_terms.assign(numEdges + 1, (double)0.0);
 	}
 
-	//ɭֵ
-	void Forest::Destroy()
+	void DriftMonitor::SetCallback(const DriftCallback& callback)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_callback = callback;
+	}
+
+	size_t DriftMonitor::Bin(double score) const
+	{
+		return (size_t)(std::upper_bound(m_edges.begin(), m_edges.end(), score) - m_edges.begin());
+	}
+
+	//һPSIеıڵĴС㣬֮ǰֵʹá
+	double DriftMonitor::Term(size_t bin) const
+	{
+		double fraction = ((double)m_counts[bin] + (double)0.5) / ((double)m_window.size() + (double)0.5 * (double)m_counts.size());
+		return (fraction - m_referenceFractions[bin]) * log(fraction / m_referenceFractions[bin]);
+	}
+
+	void DriftMonitor::AddLocked(double score, bool& crossed, double& divergence)
 	{
-		std::vector<NodePtr>::iterator iter = m_trees.begin();
-		while (iter != m_trees.end())
+		uint32_t bin = (uint32_t)Bin(score);
+		if (m_filled == m_window.size())
 		{
-			NodePtr tree = (*iter);
-			if (tree)
+			uint32_t oldBin = m_window[m_next];
+			--m_counts[oldBin];
+			m_divergence -= m_terms[oldBin];
+			m_terms[oldBin] = Term(oldBin);
+			m_divergence += m_terms[oldBin];
+		}
+		else
+		{
+			++m_filled;
+		}
+		m_window[m_next] = bin;
+		++m_counts[bin];
+		m_divergence -= m_terms[bin];
+		m_terms[bin] = Term(bin);
+		m_divergence += m_terms[bin];
+
+		// ÿתһȦһΣۻ
+		if (++m_next == m_window.size())
+		{
+			m_next = 0;
+			m_divergence = (double)0.0;
+			for (size_t i = 0; i < m_counts.size(); ++i)
 			{
-				delete tree;
+				m_terms[i] = Term(i);
+				m_divergence += m_terms[i];
 			}
-			++iter;
 		}
-		m_trees.clear();
+
+		if (m_filled == m_window.size() && m_divergence > m_threshold && !m_drifted.load(std::memory_order_relaxed))
+		{
+			m_drifted.store(true, std::memory_order_release);
+			crossed = true;
+			divergence = m_divergence;
+		}
 	}
 
-	//ͷԶеĻ
-	void Forest::DestroyRandomizer()
+	void DriftMonitor::Add(double score)
 	{
-		if (m_randomizer)
+		Add(&score, 1);
+	}
+
+	//صãصпԵ Reset()
+	void DriftMonitor::Add(const double* scores, size_t numScores)
+	{
+		bool crossed = false;
+		double divergence = (double)0.0;
+		DriftCallback callback;
 		{
-			delete m_randomizer;
-			m_randomizer = NULL;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (size_t i = 0; i < numScores; ++i)
+			{
+				AddLocked(scores[i], crossed, divergence);
+			}
+			if (crossed)
+			{
+				callback = m_callback;
+			}
 		}
+		if (callback)
+		{
+			callback(divergence);
+		}
+	}
+
+	void DriftMonitor::Reset()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::fill(m_counts.begin(), m_counts.end(), 0);
+		std::fill(m_terms.begin(), m_terms.end(), (double)0.0);
+		m_next = 0;
+		m_filled = 0;
+		m_divergence = (double)0.0;
+		m_drifted.store(false, std::memory_order_release);
+	}
+
+	double DriftMonitor::Divergence() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return (m_filled == m_window.size()) ? m_divergence : (double)0.0;
 	}
 
+	size_t DriftMonitor::WindowFill() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_filled;
+	}
+
+#ifdef _WIN32
 	void traverseDir(const char *dir, vector<string> &vfile, vector<string> &vname)
 	{
 		//жĿ¼ṹ//
@@ -352,6 +3568,52 @@ namespace IsolationForest
 			queue_dir.pop();
 		}
 	}
+#else
+	void traverseDir(const char *dir, vector<string> &vfile, vector<string> &vname)
+	{
+		queue<string> queue_dir;//öʵֵݹ
+		string rootDir(dir);
+		if (!rootDir.empty() && rootDir[rootDir.size() - 1] != '/')
+		{
+			rootDir.append("/");
+		}
+		queue_dir.push(rootDir);
+
+		while (!queue_dir.empty())
+		{
+			string curDir = queue_dir.front();
+			DIR* dirHandle = opendir(curDir.c_str());
+			if (dirHandle)
+			{
+				struct dirent* entry;
+				while ((entry = readdir(dirHandle)) != NULL)
+				{
+					string path = curDir + entry->d_name;
+					struct stat pathStat;
+					if (stat(path.c_str(), &pathStat) != 0)
+					{
+						continue;
+					}
+
+					if (S_ISDIR(pathStat.st_mode))//Ŀ¼
+					{
+						if (entry->d_name[0] != '.')
+						{
+							queue_dir.push(path + "/");
+						}
+					}
+					else
+					{
+						vname.push_back(entry->d_name);
+						vfile.push_back(path);
+					}
+				}
+				closedir(dirHandle);
+			}
+			queue_dir.pop();
+		}
+	}
+#endif
 	void split(const std::string& str, const std::string& sp, std::vector<std::string>& out)
 	{
 		out.clear();
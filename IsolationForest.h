@@ -7,16 +7,27 @@
 #include <string>
 #include <time.h>
 #include <vector>
-#include <random>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <math.h>
 #include <cmath>
 #include <fstream>
 #include <algorithm>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifdef _WIN32
 #include <io.h>
+#else
+#include <dirent.h>
+#endif
 #include <stdio.h>
+#include <string.h>
 #include <queue>
+#include <functional>
+#include <condition_variable>
+#include <stdexcept>
 
 
 using namespace::std;
@@ -78,36 +89,99 @@ namespace IsolationForest
 	typedef Sample* SamplePtr;
 	typedef std::vector<SamplePtr> SamplePtrList;
 
-	// 树节点，内部使用。
-	class Node
+	// 紧凑树节点，内部使用，每个节点16字节。
+	// 一棵树的节点按先序连续存放：一个子节点紧跟在父节点之后（默认是左子节点，
+	// 按访问频率重排后可能是右子节点），另一个子节点通过相对偏移childOffset定位。
+	// 没有子节点的叶子在压缩后不再单独存放，而是记录在父节点的标志中：走到这样的叶子时，
+	// 如果样本有该叶子的特征，深度加一，否则不变，然后遍历结束。叶子的特征索引存放在childOffset中
+	// （两个子节点都是叶子时各占16位），此时另一个实际的子节点紧跟在父节点之后。
+	// 类别特征的节点按类别集合分裂：类别在集合中的样本走左边。类别都小于64时集合的位图直接存放在splitValue中，
+	// 否则splitValue是位图在 Forest 类别位图表中的位置。
+	// 延迟创建的子树在创建之前由一个占位节点代替，它的splitValue是子树在 Forest 延迟子树表中的位置。
+	struct PackedNode
 	{
-	public:
-		Node();
-		Node(const std::string& featureName, uint64_t splitValue);
-		virtual ~Node();
+		enum
+		{
+			FLAG_HAS_LEFT = 0x80000000,
+			FLAG_HAS_RIGHT = 0x40000000,
+			FLAG_LEFT_LEAF = 0x20000000,
+			FLAG_RIGHT_LEAF = 0x10000000,
+			FLAG_NEAR_RIGHT = 0x08000000,
+			FLAG_CATEGORICAL = 0x04000000,
+			FLAG_CATEGORY_TABLE = 0x02000000,
+			FLAG_LAZY = 0x01000000,
+			FEATURE_INDEX_MASK = 0x00FFFFFF
+		};
+
+		uint64_t splitValue; // 分裂值，或类别集合
+		uint32_t featureAndFlags; // 低24位为特征索引（所以一个森林最多 2^24 个特征），高位为子节点标志
+		uint32_t childOffset; // 不紧邻的子节点相对于本节点的偏移，或压缩后叶子的特征索引
+
+		uint32_t FeatureIndex() const { return featureAndFlags & FEATURE_INDEX_MASK; };
+		bool HasLeft() const { return (featureAndFlags & FLAG_HAS_LEFT) != 0; };
+		bool HasRight() const { return (featureAndFlags & FLAG_HAS_RIGHT) != 0; };
+		bool IsLeaf() const { return !HasLeft() && !HasRight() && !IsLazy(); };
+		bool IsCategorical() const { return (featureAndFlags & FLAG_CATEGORICAL) != 0; };
+		bool HasCategoryTable() const { return (featureAndFlags & FLAG_CATEGORY_TABLE) != 0; };
+		bool IsLazy() const { return (featureAndFlags & FLAG_LAZY) != 0; };
+
+		bool LeftIsLeaf() const { return (featureAndFlags & FLAG_LEFT_LEAF) != 0; };
+		bool RightIsLeaf() const { return (featureAndFlags & FLAG_RIGHT_LEAF) != 0; };
+		uint32_t LeftLeafFeature() const { return RightIsLeaf() ? (childOffset >> 16) : childOffset; };
+		uint32_t RightLeafFeature() const { return LeftIsLeaf() ? (childOffset & 0xFFFF) : childOffset; };
+		bool NearIsRight() const { return (featureAndFlags & FLAG_NEAR_RIGHT) != 0; };
+		uint32_t LeftChildOffset() const { return NearIsRight() ? childOffset : 1; };
+		uint32_t RightChildOffset() const { return (LeftIsLeaf() || NearIsRight()) ? 1 : childOffset; };
+	};
 
-		virtual std::string FeatureName() const { return m_featureName; };
-		virtual uint64_t SplitValue() const { return m_splitValue; };
+	typedef std::vector<PackedNode> PackedNodeList;
 
-		Node* Left() const { return m_left; };
-		Node* Right() const { return m_right; };
+	// 森林占用的内存（字节）。
+	struct ForestMemoryUsage
+	{
+		size_t treeBytes; // 树节点及树索引
+		size_t trainingBytes; // 训练状态：特征名称表及每个特征的唯一值集合
 
-		void SetLeftSubTree(Node* subtree);
-		void SetRightSubTree(Node* subtree);
+		size_t Total() const { return treeBytes + trainingBytes; };
+	};
 
-	private:
-		std::string m_featureName;
-		uint64_t m_splitValue;
+	// 最近一次 Create()/Grow() 如何使用内存预算。
+	struct ForestBudgetReport
+	{
+		size_t budgetBytes; // 预算，0表示不限制
+		size_t trainingBytes; // 训练状态占用的内存
+		size_t existingTreeBytes; // 之前的树占用的内存
+		size_t buildBytes; // 创建一棵树时的临时内存（估计）
+		size_t treeBytesAllowed; // 分配给新树的内存
+		size_t treeBytesUsed; // 新树实际占用的内存（压缩后）
+		uint32_t treesRequested;
+		uint32_t treesBuilt;
+		uint32_t depthLimit; // 0表示不限制
+		size_t nodesPerTreeLimit; // 每棵树压缩前的节点数上限，0表示不限制
+		uint32_t treesTruncated; // 达到节点数上限的树
+		bool overBudget; // 请求了树，但预算在训练状态和临时内存之外连一棵最小的树都容纳不下，没有创建任何树
+	};
 
-		Node* m_left;
-		Node* m_right;
+	// 一个特征在树中的使用情况。
+	struct FeatureUsage
+	{
+		std::string name;
+		uint64_t splitNodes; // 有子节点的分裂节点
+		uint64_t leafNodes; // 叶子，样本有该特征时在此被分离
+		uint32_t trees; // 引用该特征的树
 
-		void DestroyLeftSubtree();
-		void DestroyRightSubtree();
+		bool Used() const { return splitNodes + leafNodes > 0; };
 	};
 
-	typedef Node* NodePtr;
-	typedef std::vector<NodePtr> NodePtrList;
+	// 稀疏样本中的一个特征：特征索引（见 Forest::RegisterFeature）和值。
+	struct SparseFeature
+	{
+		uint32_t featureIndex;
+		uint64_t value;
+	};
+
+	// 稀疏样本，特征按索引升序排列。没有列出的特征取值为0，而不是按缺失特征处理。
+	typedef std::vector<SparseFeature> SparseSample;
 
 
 	//这个类抽象随机数生成。
@@ -117,6 +191,7 @@ namespace IsolationForest
 	{
 	public:
 		Randomizer() : m_gen(m_rand()) {} ;
+		explicit Randomizer(uint64_t seed) : m_gen(seed) {} ; // 固定种子，产生可重复的序列
 		virtual ~Randomizer() { };
 
 		virtual uint64_t Rand() { return m_dist(m_gen); };
@@ -130,8 +205,52 @@ namespace IsolationForest
 
 	typedef std::set<uint64_t> Uint64Set;
 	typedef std::map<std::string, Uint64Set> FeatureNameToValuesMap;
+	typedef std::map<std::string, uint32_t> FeatureNameToIndexMap;
+
+	struct IngestBuffer;
+	struct IngestShard;
+	struct LazySubtree;
+	struct ValueSnapshot;
+	struct ValueRange;
+
+	// 按列存放的训练数据集：每个特征一段连续的uint64数组，行数相同。
+	// 列可以由调用者提供（调用者保证在使用期间有效），也可以从列式文件内存映射。
+	// 文件格式（本机字节序）：8字节魔数"IFCOLS01"，uint64 列数，uint64 行数，
+	// 每列的名称（uint32 长度 + 字节），补齐到8字节边界，然后依次是每列的全部值。
+	class ColumnarDataset
+	{
+	public:
+		explicit ColumnarDataset(size_t numRows);
+		virtual ~ColumnarDataset();
+
+		void AddColumn(const std::string& name, const uint64_t* values);
+
+		// 映射文件，失败时返回NULL。
+		static ColumnarDataset* Open(const std::string& path);
+		static bool Write(const std::string& path, const ColumnarDataset& dataset);
+
+		size_t NumRows() const { return m_numRows; };
+		size_t NumColumns() const { return m_columns.size(); };
+		const std::string& ColumnName(size_t column) const { return m_names[column]; };
+		const uint64_t* Column(size_t column) const { return m_columns[column]; };
+
+	private:
+		size_t m_numRows;
+		std::vector<std::string> m_names;
+		std::vector<const uint64_t*> m_columns;
+		void* m_mapping; // 映射的文件内容，调用者提供的列时为NULL
+		size_t m_mappingSize;
+#ifdef _WIN32
+		void* m_fileHandle;
+		void* m_mappingHandle;
+#endif
+
+		ColumnarDataset(const ColumnarDataset&);
+		ColumnarDataset& operator=(const ColumnarDataset&);
+	};
 
-	// 孤立森林类
+	// 孤立森林类。特征索引只有24位，一个森林最多 2^24 个不同的特征：超过时加入新特征的调用
+	// （AddSample、AddSamples、SetCategorical 等）抛出 std::length_error，Merge() 返回 false。
 	class Forest
 	{
 	public:
@@ -141,20 +260,435 @@ namespace IsolationForest
 
 		void SetRandomizer(Randomizer* newRandomizer);
 		void AddSample(const Sample& sample);
-		void Create();
-		double Score(const Sample& sample);
+		bool Create();
+		size_t Grow(uint32_t numTrees);
+		size_t GrowUntilConverged(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples, double tolerance, uint32_t step, uint32_t maxTrees);
+		double Score(const Sample& sample) const;
+		double Score(const Sample& sample, std::vector<double>& contributions) const;
+
+		// 批量接口，values为按行存放的 numSamples x featureNames.size() 矩阵，调用者保留其所有权。
+		void AddSamples(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples);
+		void Score(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples, double* scores) const;
+
+		// 异常比例。在加入样本之前设置后，训练样本中最多sampleRows行的随机样本（蓄水池抽样）被保留下来，
+		// Create()/Grow() 之后对它们评分，取比例为contamination处的分位数作为阈值。分数是平均路径长度，
+		// 越小越异常，分数不大于阈值的样本为异常。并发采集接口加入的样本不参与抽样。
+		// 这些分数同时作为参考分布（见 DriftMonitor）；contamination为0时只保存参考分布，不设阈值。
+		// Merge() 之后用保留的行重新计算阈值和参考分布；Load() 清空保留的行和参考分布，阈值恢复为未设置。
+		void SetContamination(double contamination, size_t sampleRows);
+		double OutlierThreshold() const { return m_outlierThreshold; };
+		const std::vector<double>& ReferenceScores() const { return m_referenceScores; }; // 升序
+		bool IsOutlier(const Sample& sample) const;
+		bool IsOutlier(const SparseSample& sample) const;
+		void IsOutlier(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples, uint8_t* outliers) const;
+
+		// 分片训练：第i棵树的随机数只由 (seed, i) 决定，与由哪个进程创建无关。各进程用相同的训练数据创建
+		// [firstTree, firstTree + numTrees) 中的树并 Save，协调者 Load 后按firstTree的顺序 Merge，
+		// 结果与在一个进程中调用 GrowShard(seed, 0, 总数) 完全相同。
+		size_t GrowShard(uint64_t seed, uint32_t firstTree, uint32_t numTrees);
+
+		// 把另一个森林的树追加到本森林，特征按名称对应。失败时（特征索引放不进压缩叶子的16位）本森林不变。
+		bool Merge(const Forest& other);
+
+		// 保存和读取树及特征表。Load 替换当前的树和特征表，并清空训练状态。
+		bool Save(const std::string& path) const;
+		bool Load(const std::string& path);
+
+		// 延迟创建子树。depth > 0 时，之后创建的树在深度depth处的每个子树改用由树的种子和子树的位置确定的随机数
+		// （GrowShard 的树的种子由seed决定，其他的树的种子取自随机化器）。lazy为true时这些子树不在 Create()/Grow() 中创建，
+		// 而是在评分第一次到达时创建，多个线程同时评分时每个子树也只创建一次。同样的随机化器或种子、同样的depth下，
+		// 延迟创建与立即创建的树完全相同：评分相同，BuildLazySubtrees() 之后节点也相同（类别位图的位置除外）。
+		// 类别特征取 Create()/Grow() 时的设置，之后的 SetCategorical() 不影响这些树的延迟子树。内存预算的节点数上限不作用于
+		// 延迟的子树。Nodes() 在 BuildLazySubtrees() 之前含有占位节点（IsLazy()）；有未放回的子树时 DeltaScorer 的构造函数
+		// 抛出异常，Save() 和以本森林为参数的 Merge() 失败。
+		void SetLazySubtrees(uint32_t depth, bool lazy);
+		void BuildLazySubtrees(); // 创建所有剩余的子树并放回树中，树恢复为立即创建时的紧凑布局。不能与评分并发调用。
+		size_t NumLazySubtrees() const; // 尚未创建的子树数
+
+		// 每个特征在树中的使用情况，按特征索引排列。尚未创建的延迟子树会先被创建。
+		std::vector<FeatureUsage> FeatureUsageReport() const;
+		std::vector<std::string> UsedFeatures() const; // 至少被一个节点引用的特征
+
+		// 投影：只采集列出的特征，其他特征在所有采集接口中被跳过，不分配索引，也不保存任何值。
+		// 按列的接口每批只判断一次每一列；AddSample 对已有索引的特征使用按特征索引预先算好的标志，
+		// 不再查找投影，只有投影之外的特征每次查找。重新训练同样格式的模型时，
+		// 通常用上一个模型的 UsedFeatures()。空列表表示采集所有特征。只影响之后加入的样本。
+		void SetProjection(const std::vector<std::string>& featureNames);
+		bool IsProjected(const std::string& featureName) const { return m_projection.empty() || m_projection.count(featureName) > 0; };
+
+		// 树和训练状态合计的内存预算（字节），0表示不限制。Create()/Grow() 时训练状态已经确定，剩余的预算扣除创建一棵树的
+		// 临时内存后分给新树：先按每棵树可用的节点数限制深度和节点数，每棵树的节点太少时再减少树的数量。
+		// 预算连一棵树都容纳不下时不创建树，Create() 返回false，BudgetReport().overBudget 为true。
+		// 预算不包括向量扩容时的临时内存。
+		void SetMemoryBudget(size_t budgetBytes) { m_memoryBudget = budgetBytes; };
+		const ForestBudgetReport& BudgetReport() const { return m_budgetReport; };
+
+		// 批量评分按“树块 x 样本块”分块进行：一块树的节点放在L2缓存中，一块样本的特征值和累加器放在L1缓存中。
+		// 参数为0时根据检测到的缓存大小自动选择。
+		void SetBatchSchedule(size_t treeBlockBytes, size_t samplesPerBlock);
+
+		// 批量评分时同时推进的游标数（同一棵树上的不同样本）。每个游标前进一步后预取它的下一个节点，
+		// 用其他游标的计算掩盖访存延迟。0或1表示逐个样本遍历。结果与逐个遍历完全相同。
+		void SetInterleave(size_t numCursors) { m_interleave = numCursors; };
+
+		// 用一批有代表性的样本统计每条边的访问次数，然后重排每棵树的节点，
+		// 让访问更多的子节点紧跟在父节点之后。评分结果不变。不能与评分并发调用。
+		void OptimizeLayout(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples);
+
+		// 按列读取数据集，不创建任何按行的对象。
+		void AddDataset(const ColumnarDataset& dataset);
+
+		// 可由多个线程同时调用的采集接口。每个线程写入自己的分片缓冲区，Create() 时合并，
+		// 结果与按调用的顺序串行调用 AddSample/AddSamples 相同，包括 FeatureNames() 中特征的顺序。
+		// 不能与 Create() 以外的其他成员函数并发调用。
+		void AddSampleConcurrent(const Sample& sample);
+		void AddSamplesConcurrent(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples);
+
+		// 把特征标记为类别特征，在 Create() 之前调用。类别特征的值是类别编号，节点按随机的类别子集分裂，
+		// 评分时只需测试一位。编号应从0开始连续分配；最大编号不小于 MAX_CATEGORIES 的特征仍按数值分裂。
+		enum { MAX_CATEGORIES = 1 << 16 };
+		void SetCategorical(const std::string& featureName);
+
+		// 稀疏接口，用于特征很多而每个样本只设置少数特征的模型。稀疏样本与其余特征都填0的稠密样本训练和评分结果相同，
+		// 评分只需处理样本中列出的特征。训练时只为出现过的特征保存状态。
+		// 批量接口按CSR存放样本：第i个样本为 features[rowOffsets[i], rowOffsets[i + 1])。
+		uint32_t RegisterFeature(const std::string& featureName);
+		bool FindFeature(const std::string& featureName, uint32_t& featureIndex) const;
+		void AddSample(const SparseSample& sample);
+		void AddSamples(const size_t* rowOffsets, const SparseFeature* features, size_t numSamples);
+		double Score(const SparseSample& sample) const;
+		void Score(const size_t* rowOffsets, const SparseFeature* features, size_t numSamples, double* scores) const;
+
+		size_t NumTrees() const { return m_treeRoots.size(); };
+		size_t NumNodes() const { return m_nodes.size(); };
+		uint64_t Generation() const { return m_generation; }; // 树每次改变时更新，所有森林之间唯一
+		const std::vector<std::string>& FeatureNames() const { return m_featureNames; };
+		const PackedNodeList& Nodes() const { return m_nodes; };
+		const std::vector<uint32_t>& TreeRoots() const { return m_treeRoots; };
+		ForestMemoryUsage MemoryUsage() const;
 
 	private:
 		Randomizer* m_randomizer; // 执行随机数生成
 		FeatureNameToValuesMap m_featureValues; // 列出每个特征并将其映射到训练集中的所有唯一值
-		NodePtrList m_trees; // 构成森林的决策树
+		FeatureNameToIndexMap m_featureIndices; // 特征名称到特征索引的映射
+		std::vector<std::string> m_featureNames; // 特征索引到特征名称的映射
+		PackedNodeList m_nodes; // 所有树的紧凑节点，按树依次存放
+		std::vector<uint32_t> m_treeRoots; // 每棵树根节点在m_nodes中的位置
 		uint32_t m_numTreesToCreate; //创建树的最大数量
 		uint32_t m_subSamplingSize; // 树的最大深度
-
-		NodePtr CreateTree(const FeatureNameToValuesMap& featureValues, size_t depth);
-		double Score(const Sample& sample, const NodePtr tree);
+		size_t m_treeBlockBytes; // 批量评分时每个树块的节点字节数，0表示自动
+		size_t m_samplesPerBlock; // 批量评分时每个样本块的样本数，0表示自动
+		size_t m_interleave; // 批量评分时交错推进的游标数
+		std::vector<std::unique_ptr<IngestShard> > m_ingestShards; // 并发采集的分片缓冲区
+		std::atomic<uint64_t> m_ingestCalls; // 并发采集调用的序号，决定合并时新特征的索引顺序
+		std::vector<uint8_t> m_categoricalFeatures; // 按特征索引，是否为类别特征
+		std::vector<uint64_t> m_categoryTable; // 类别位图表，每个位图为字数加上各字
+		uint64_t m_sparseRows; // 加入的稀疏样本数
+		uint64_t m_generation; // 当前的树的全局唯一编号
+		double m_contamination; // 异常比例，0表示不估计阈值
+		size_t m_thresholdSampleRows; // 为估计阈值保留的最大行数
+		uint64_t m_thresholdRowsSeen; // 参与抽样的行数
+		std::vector<std::pair<bool, SparseSample> > m_thresholdRows; // 保留的行，first表示是否为稀疏样本
+		std::mt19937_64 m_thresholdRandom; // 抽样使用独立的随机数，不影响树
+		double m_outlierThreshold; // 分数不大于它的样本为异常
+		std::vector<double> m_referenceScores; // 保留的行最近一次的分数，升序
+		size_t m_memoryBudget; // 内存预算，0表示不限制
+		ForestBudgetReport m_budgetReport;
+		uint32_t m_depthLimit; // 创建树时的深度上限，0表示不限制
+		size_t m_nodeLimit; // 创建树时每棵树的节点数上限，0表示不限制
+		size_t m_treeStart; // 正在创建的树的根节点位置
+		bool m_treeTruncated; // 正在创建的树是否达到了节点数上限
+		std::vector<uint64_t> m_sparseFeatureRows; // 按特征索引，列出该特征的稀疏样本数
+		uint32_t m_subtreeDepth; // 子树改用独立随机数的深度，0表示不使用
+		bool m_lazy; // 是否延迟创建这些子树
+		bool m_buildingSubtree; // 正在创建这样的子树
+		uint64_t m_treeSeed; // 正在创建的树的种子
+		PackedNodeList* m_buildNodes; // 创建树时节点写入的位置
+		std::vector<uint64_t>* m_buildCategoryTable; // 创建树时类别位图写入的位置
+		const ValueSnapshot* m_buildSnapshot; // 创建树时使用的训练值和类别特征标志
+		std::vector<uint64_t>* m_buildListed; // 创建树时类别分裂后的值集合写入的位置
+		std::shared_ptr<const ValueSnapshot> m_lazySnapshot; // 最近一次延迟创建时的训练值
+		std::vector<std::unique_ptr<LazySubtree> > m_lazySubtrees; // 延迟子树表
+		std::vector<uint32_t> m_lazyTrees; // 含有占位节点的树，这些树没有压缩
+		mutable std::mutex m_lazyMutex; // 创建延迟子树时持有
+		std::set<std::string> m_projection; // 投影中的特征，空表示采集所有特征
+		std::vector<uint8_t> m_projectedFeatures; // 按特征索引，特征是否在投影中
+
+		uint32_t FeatureIndex(const std::string& featureName);
+		bool ProjectedFeatureIndex(const std::string& featureName, uint32_t& featureIndex);
+		void AddColumn(const std::string& featureName, const uint64_t* values, size_t numValues, size_t stride);
+		void CreateIngestShards();
+		IngestShard& CurrentIngestShard();
+		IngestBuffer& ShardBuffer(IngestShard& shard, const std::string& featureName, uint64_t call, size_t column);
+		void MergeIngestShards();
+		void AddSparseDefaults();
+		uint32_t PlanBudget(uint32_t numTrees);
+		bool ReserveThresholdRow(size_t& slot);
+		void UpdateOutlierThreshold();
+		size_t GrowTrees(uint32_t numTrees, const uint64_t* seed, uint32_t firstSeededTree, bool updateThreshold);
+		double ScoreSparse(const SparseFeature* features, size_t numFeatures) const;
+		const uint64_t* RangeValues(size_t feature, const ValueRange& range) const;
+		bool CreateTree(std::vector<ValueRange>& ranges, size_t depth, uint64_t position);
+		bool CreateCategoricalNode(std::vector<ValueRange>& ranges, size_t feature, size_t depth, uint64_t position);
+		bool CreateSubtree(std::vector<ValueRange>& ranges, size_t depth, uint64_t position);
+		const LazySubtree& BuiltLazySubtree(uint64_t subtreeIndex) const;
+		void BuildLazySubtree(LazySubtree& subtree);
+		void CountFeatureUsage(const PackedNode* nodes, size_t numNodes, uint32_t treeStamp, std::vector<FeatureUsage>& usage, std::vector<uint32_t>& treeStamps) const;
+		void SpliceSubtree(const PackedNode* nodes, uint32_t nodeIndex, uint64_t categoryOffset, PackedNodeList& spliced);
+		bool GoesLeft(const PackedNode& node, uint64_t value) const;
+		bool GoesLeft(const PackedNode& node, uint64_t value, const uint64_t* categoryTable) const;
+		void CompactTrees(size_t firstTree);
+		void CompactSubtree(const PackedNode* nodes, uint32_t nodeIndex, PackedNodeList& compacted) const;
+		void ReorderSubtree(const PackedNode* nodes, uint32_t nodeIndex, const std::vector<uint64_t>& edgeCounts, PackedNodeList& reordered) const;
+		void ResolveFeatures(const Sample& sample, std::vector<uint64_t>& values, std::vector<uint8_t>& present) const;
+		void ScoreBlock(const uint64_t* resolved, const uint8_t* present, size_t numSamples, size_t firstTree, size_t lastTree, double* depthSums) const;
+		void ScoreBlockInterleaved(const uint64_t* resolved, const uint8_t* present, size_t numSamples, size_t firstTree, size_t lastTree, double* depthSums) const;
+		void ResolveColumns(const std::vector<std::string>& featureNames, std::vector<uint8_t>& present, std::vector<size_t>& columns, std::vector<uint32_t>& columnFeatures) const;
+		template <class Visitor>
+		double WalkTree(const uint64_t* values, const uint8_t* present, uint32_t nodeIndex, double baseDepth, Visitor visitor) const;
+		template <class Visitor>
+		double WalkNodes(const PackedNode* nodes, const uint64_t* categoryTable, const uint64_t* values, const uint8_t* present, uint32_t nodeIndex, double baseDepth, Visitor visitor) const;
+		template <class Visitor>
+		double LeafDepth(const uint8_t* present, uint32_t featureIndex, double baseDepth, Visitor visitor) const;
+		double Score(const uint64_t* values, const uint8_t* present, uint32_t nodeIndex) const;
+		double ScoreResolved(const uint64_t* values, const uint8_t* present) const;
 		void Destroy();
 		void DestroyRandomizer();
+
+		// 森林持有随机化器的所有权，不可复制。
+		Forest(const Forest&);
+		Forest& operator=(const Forest&);
+
+		friend class DeltaScorer;
+		friend class ParallelScorer;
+	};
+
+	// 增量评分器：保存一个样本在每棵树上的路径和深度。样本的一个特征更新后，只重新遍历路径经过该特征节点的树，
+	// 并且从该节点开始，开销与受影响的树的数量成正比。分数与对更新后的样本调用 Forest::Score 完全相同。
+	// 评分器引用森林，森林在评分器使用期间不能被修改。森林中还有延迟子树的占位节点时（BuildLazySubtrees() 之前），
+	// 构造函数抛出 std::invalid_argument。
+	class DeltaScorer
+	{
+	public:
+		explicit DeltaScorer(const Forest& forest);
+		virtual ~DeltaScorer() {};
+
+		// 设置新的样本并遍历所有的树。
+		double Reset(const Sample& sample);
+
+		// 设置一个特征的值（原来缺失的特征变为存在）并返回新的分数。不在森林中的特征不影响分数。
+		double Update(const std::string& featureName, uint64_t value);
+		double Update(uint32_t featureIndex, uint64_t value);
+
+		double Score() const { return m_score; };
+		size_t TreesRewalked() const { return m_treesRewalked; }; // 上一次更新重新遍历的树的数量
+
+	private:
+		// 路径上的一步：节点、决定这一步的特征（压缩后的叶子为叶子的特征）以及到达该节点时的深度。
+		struct PathStep
+		{
+			uint32_t nodeIndex;
+			uint32_t featureIndex;
+			double depth;
+		};
+
+		const Forest& m_forest;
+		std::vector<uint64_t> m_values; // 按特征索引排列的样本值
+		std::vector<uint8_t> m_present;
+		std::vector<std::vector<PathStep> > m_paths; // 每棵树的路径
+		std::vector<double> m_treeDepths; // 每棵树的深度
+		std::vector<std::vector<uint32_t> > m_featureTrees; // 按特征索引，路径可能经过该特征的树（可能有过期的项）
+		std::vector<uint64_t> m_treeStamps; // 每棵树最后一次被检查时的更新序号，用于去重
+		size_t m_featureTreeEntries;
+		size_t m_pathSteps; // 所有路径的总步数，即列表中有效的项数
+		uint64_t m_updateStamp;
+		size_t m_treesRewalked;
+		double m_score;
+
+		void WalkFrom(size_t tree, size_t step);
+		void AddBranchSteps(uint32_t branchIndex, uint32_t nodeIndex, double branchDepth, std::vector<PathStep>& path) const;
+		void RebuildFeatureTrees();
+		void SumDepths();
+
+		DeltaScorer(const DeltaScorer&);
+		DeltaScorer& operator=(const DeltaScorer&);
+	};
+
+	typedef std::shared_ptr<const Forest> ForestConstPtr;
+
+	// 可热替换的模型句柄。每个评分线程缓存一份当前森林的快照，并用原子的版本号检查快照是否过时：
+	// 版本没变时评分只读一次版本号，不加锁，也不修改共享的引用计数，评分线程之间不争用同一缓存行。
+	// Publish() 和版本变化后各线程的第一次评分持有一个互斥锁，只在这两者之间互斥。
+	// 旧森林在最后一个缓存它的线程换到新版本（或退出）之后回收，空闲的线程会让它多保留一段时间。
+	// 每个线程只缓存最近使用的一个句柄，交替使用多个句柄时每次切换都走加锁的路径。
+	class ForestHandle
+	{
+	public:
+		ForestHandle();
+		explicit ForestHandle(ForestConstPtr forest);
+
+		ForestConstPtr Acquire() const;
+		uint64_t Publish(ForestConstPtr forest);
+		uint64_t Version() const { return m_version.load(); };
+
+		double Score(const Sample& sample) const;
+		void Score(const std::vector<std::string>& featureNames, const uint64_t* values, size_t numSamples, double* scores) const;
+
+	private:
+		friend class ScoreCache;
+
+		const uint64_t m_id; // 进程内唯一，线程的快照按它识别句柄
+		ForestConstPtr m_forest; // 由m_publishMutex保护
+		std::atomic<uint64_t> m_version; // 每次发布递增，在m_forest更新之后写入
+		mutable std::mutex m_publishMutex;
+
+		const Forest* Current() const;
+
+		ForestHandle(const ForestHandle&);
+		ForestHandle& operator=(const ForestHandle&);
+	};
+
+	struct ScoreCacheStats
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+	};
+
+	// 有界的分数缓存，放在评分前面，适合大量重复的特征向量。键是固定列（构造时给定）的特征值，
+	// 按哈希分组，每组WAYS项，组满时轮流替换。缓存项记录森林的 Generation()，模型改变后旧的项不再命中。
+	// 可由多个线程同时使用。分数与不使用缓存时完全相同。
+	class ScoreCache
+	{
+	public:
+		ScoreCache(const std::vector<std::string>& featureNames, size_t capacity);
+		virtual ~ScoreCache() {};
+
+		double Score(const Forest& forest, const uint64_t* values);
+		void Score(const Forest& forest, const uint64_t* values, size_t numSamples, double* scores);
+		void Score(const ForestHandle& handle, const uint64_t* values, size_t numSamples, double* scores);
+
+		void Clear();
+		ScoreCacheStats Stats() const;
+		size_t Capacity() const { return m_entries.size(); };
+
+	private:
+		enum { WAYS = 4, NUM_LOCKS = 64 };
+
+		struct Entry
+		{
+			uint64_t hash;
+			uint64_t generation; // 0表示空
+			double score;
+		};
+
+		std::vector<std::string> m_featureNames;
+		size_t m_numSets;
+		std::vector<Entry> m_entries; // 按组存放，每组WAYS项
+		std::vector<uint64_t> m_keys; // 每项的特征值
+		std::vector<uint8_t> m_nextVictims; // 每组下一个被替换的项
+		std::mutex m_locks[NUM_LOCKS]; // 第i组使用 m_locks[i % NUM_LOCKS]
+		std::atomic<uint64_t> m_hits;
+		std::atomic<uint64_t> m_misses;
+		std::atomic<uint64_t> m_evictions;
+
+		uint64_t Hash(const uint64_t* values) const;
+		bool Find(uint64_t generation, uint64_t hash, const uint64_t* values, double& score);
+		void Insert(uint64_t generation, uint64_t hash, const uint64_t* values, double score);
+
+		ScoreCache(const ScoreCache&);
+		ScoreCache& operator=(const ScoreCache&);
+	};
+
+	// 单样本的树并行评分器，用于每次只评分一个样本、要求低延迟的调用者。森林的树按数量平均分成numThreads段（不超过树的数量），
+	// 调用线程评分第一段，其余各段由工作线程评分（pinThreads为true时各自固定在进程允许使用的一个CPU上）。工作线程在两次评分之间
+	// 自旋等待，交接工作只需写一个序号，不经过系统调用；自旋一段时间没有工作后在条件变量上等待，空闲时不占用CPU，
+	// 此后的第一次评分需要唤醒它们。每棵树的深度写入各自的位置，最后按树的顺序求和，分数与 Forest::Score 完全相同。
+	// 线程数多于空闲的CPU时分数仍然正确，但交接要等待调度，延迟反而增加，通常不要超过 std::thread::hardware_concurrency()。
+	// 评分器引用森林，森林在评分器使用期间不能被修改。Score 可由多个线程调用，调用之间互相串行。
+	class ParallelScorer
+	{
+	public:
+		ParallelScorer(const Forest& forest, size_t numThreads, bool pinThreads);
+		virtual ~ParallelScorer();
+
+		double Score(const Sample& sample);
+		double Score(const uint64_t* values); // 按特征索引排列的完整样本（见 Forest::FeatureNames()）
+		size_t NumThreads() const { return m_treeRanges.size() - 1; };
+
+	private:
+		const Forest& m_forest;
+		std::vector<size_t> m_treeRanges; // 第i段为 [m_treeRanges[i], m_treeRanges[i + 1])，第0段由调用线程评分
+		std::vector<double> m_depths; // 每棵树的深度
+		std::vector<uint64_t> m_values; // Score(Sample) 解析后的样本
+		std::vector<uint8_t> m_present;
+		std::vector<uint8_t> m_allPresent;
+		const uint64_t* m_sampleValues; // 正在评分的样本
+		const uint8_t* m_samplePresent;
+		char m_padding0[64];
+		std::atomic<uint64_t> m_epoch; // 每次评分加一，工作线程看到变化后开始
+		char m_padding1[64];
+		std::atomic<size_t> m_done; // 本次评分完成的工作线程数
+		char m_padding2[64];
+		std::atomic<size_t> m_parked; // 在条件变量上等待的工作线程数
+		std::atomic<bool> m_stop;
+		std::mutex m_parkMutex;
+		std::condition_variable m_wake;
+		std::vector<std::thread> m_workers;
+		std::mutex m_mutex;
+
+		double ScoreResolved(const uint64_t* values, const uint8_t* present);
+		void ScoreRange(size_t range);
+		void WakeParked();
+		void WorkerLoop(size_t range, bool pinThread, size_t cpu);
+
+		ParallelScorer(const ParallelScorer&);
+		ParallelScorer& operator=(const ParallelScorer&);
+	};
+
+	// 分数漂移监视器。按参考分数（通常是 Forest::ReferenceScores()，即 Create() 时训练样本的分数）的分位数
+	// 把分数分成numBins个区间，最近windowSize个分数放在环形缓冲区中，每个区间记录窗口中落入的数量。
+	// 窗口与参考分布的差异用PSI衡量：sum((p - q) * ln(p / q))，每个区间的比例加0.5个计数平滑；
+	// 通常0.1以下为稳定，0.25以上为明显漂移。每加入一个分数只更新进出窗口的两个区间的项，
+	// 开销与窗口大小无关（查找区间是对numBins - 1个边界的二分查找）。窗口填满后散度超过阈值时设置标志，
+	// 并调用一次回调，之后直到 Reset() 不再调用。可由多个线程同时加入分数。
+	class DriftMonitor
+	{
+	public:
+		typedef std::function<void(double divergence)> DriftCallback;
+
+		DriftMonitor(const std::vector<double>& referenceScores, size_t numBins, size_t windowSize, double threshold);
+		virtual ~DriftMonitor() {};
+
+		void SetCallback(const DriftCallback& callback);
+		void Add(double score);
+		void Add(const double* scores, size_t numScores);
+		void Reset(); // 清空窗口和标志
+
+		double Divergence() const; // 窗口未满时为0
+		bool Drifted() const { return m_drifted.load(std::memory_order_acquire); };
+		size_t WindowFill() const;
+
+	private:
+		std::vector<double> m_edges; // 区间边界：第i个区间为 [edges[i - 1], edges[i])
+		std::vector<double> m_referenceFractions; // 每个区间中参考分数的比例（平滑后）
+		std::vector<uint32_t> m_window; // 环形缓冲区，保存每个分数的区间
+		std::vector<uint32_t> m_counts; // 每个区间在窗口中的数量
+		std::vector<double> m_terms; // 每个区间的PSI项
+		size_t m_next; // 下一个写入的位置
+		size_t m_filled;
+		double m_divergence; // m_terms之和
+		double m_threshold;
+		std::atomic<bool> m_drifted;
+		DriftCallback m_callback;
+		mutable std::mutex m_mutex;
+
+		size_t Bin(double score) const;
+		double Term(size_t bin) const;
+		void AddLocked(double score, bool& crossed, double& divergence);
+
+		DriftMonitor(const DriftMonitor&);
+		DriftMonitor& operator=(const DriftMonitor&);
 	};
 
 
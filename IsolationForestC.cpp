@@ -0,0 +1,145 @@
+#include "IsolationForestC.h"
+#include "IsolationForest.h"
+#include <new>
+#include <stdexcept>
+
+using namespace IsolationForest;
+
+struct IF_Forest
+{
+	IF_Forest(uint32_t numTrees, uint32_t subSamplingSize) : forest(numTrees, subSamplingSize) {};
+
+	Forest forest;
+};
+
+namespace
+{
+	bool MakeFeatureNames(const char* const* featureNames, size_t numFeatures, std::vector<std::string>& names)
+	{
+		if (!featureNames && numFeatures > 0)
+		{
+			return false;
+		}
+
+		names.reserve(numFeatures);
+		for (size_t i = 0; i < numFeatures; ++i)
+		{
+			if (!featureNames[i])
+			{
+				return false;
+			}
+			names.push_back(featureNames[i]);
+		}
+		return true;
+	}
+}
+
+IF_Forest* IF_CreateForest(uint32_t numTrees, uint32_t subSamplingSize)
+{
+	return new (std::nothrow) IF_Forest(numTrees, subSamplingSize);
+}
+
+void IF_DestroyForest(IF_Forest* forest)
+{
+	delete forest;
+}
+
+int IF_AddSamples(IF_Forest* forest, const char* const* featureNames, size_t numFeatures, const uint64_t* values, size_t numSamples)
+{
+	if (!forest || (!values && numSamples > 0))
+	{
+		return IF_ERROR_INVALID_ARGUMENT;
+	}
+
+	try
+	{
+		std::vector<std::string> names;
+		if (!MakeFeatureNames(featureNames, numFeatures, names))
+		{
+			return IF_ERROR_INVALID_ARGUMENT;
+		}
+		forest->forest.AddSamples(names, values, numSamples);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return IF_ERROR_OUT_OF_MEMORY;
+	}
+	catch (...)
+	{
+		return IF_ERROR_INTERNAL;
+	}
+	return IF_OK;
+}
+
+int IF_Create(IF_Forest* forest)
+{
+	if (!forest)
+	{
+		return IF_ERROR_INVALID_ARGUMENT;
+	}
+
+	try
+	{
+		forest->forest.Create();
+	}
+	catch (const std::bad_alloc&)
+	{
+		return IF_ERROR_OUT_OF_MEMORY;
+	}
+	catch (...)
+	{
+		return IF_ERROR_INTERNAL;
+	}
+	return IF_OK;
+}
+
+int IF_Score(const IF_Forest* forest, const char* const* featureNames, size_t numFeatures, const uint64_t* values, size_t numSamples, double* scores)
+{
+	if (!forest || ((!values || !scores) && numSamples > 0))
+	{
+		return IF_ERROR_INVALID_ARGUMENT;
+	}
+
+	try
+	{
+		std::vector<std::string> names;
+		if (!MakeFeatureNames(featureNames, numFeatures, names))
+		{
+			return IF_ERROR_INVALID_ARGUMENT;
+		}
+		forest->forest.Score(names, values, numSamples, scores);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return IF_ERROR_OUT_OF_MEMORY;
+	}
+	catch (...)
+	{
+		return IF_ERROR_INTERNAL;
+	}
+	return IF_OK;
+}
+
+size_t IF_NumTrees(const IF_Forest* forest)
+{
+	return forest ? forest->forest.NumTrees() : 0;
+}
+
+int IF_MemoryUsage(const IF_Forest* forest, size_t* treeBytes, size_t* trainingBytes)
+{
+	if (!forest)
+	{
+		return IF_ERROR_INVALID_ARGUMENT;
+	}
+
+	ForestMemoryUsage usage = forest->forest.MemoryUsage();
+	if (treeBytes)
+	{
+		*treeBytes = usage.treeBytes;
+	}
+	if (trainingBytes)
+	{
+		*trainingBytes = usage.trainingBytes;
+	}
+	return IF_OK;
+}
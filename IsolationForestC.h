@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 孤立森林的C接口。所有函数都不会抛出异常，失败时返回负的错误码。
+// 样本矩阵按行存放（numSamples x numFeatures），调用期间直接读取调用者的内存，不做拷贝。
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	typedef struct IF_Forest IF_Forest;
+
+	enum
+	{
+		IF_OK = 0,
+		IF_ERROR_INVALID_ARGUMENT = -1,
+		IF_ERROR_OUT_OF_MEMORY = -2,
+		IF_ERROR_INTERNAL = -3
+	};
+
+	IF_Forest* IF_CreateForest(uint32_t numTrees, uint32_t subSamplingSize);
+	void IF_DestroyForest(IF_Forest* forest);
+
+	int IF_AddSamples(IF_Forest* forest, const char* const* featureNames, size_t numFeatures, const uint64_t* values, size_t numSamples);
+	int IF_Create(IF_Forest* forest);
+	int IF_Score(const IF_Forest* forest, const char* const* featureNames, size_t numFeatures, const uint64_t* values, size_t numSamples, double* scores);
+
+	size_t IF_NumTrees(const IF_Forest* forest);
+	int IF_MemoryUsage(const IF_Forest* forest, size_t* treeBytes, size_t* trainingBytes);
+
+#ifdef __cplusplus
+}
+#endif
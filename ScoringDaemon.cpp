@@ -0,0 +1,639 @@
+// 本地评分守护进程（POSIX）。在Unix域套接字上提供评分服务，所有调用者共享同一个森林，
+// 并把并发请求合并成小批量调用 Forest::Score 的批量接口。
+//
+// 用法: ScoringDaemon <socket路径> <训练文件> [--trees N] [--depth D] [--max-batch B] [--max-wait-us U] [--max-connections C]
+// 训练文件第一行是以制表符分隔的特征名称，之后每行是一个样本的无符号整数特征值。
+//
+// 协议（本机字节序）:
+//   请求: uint32 op, uint32 count, 然后 count * numFeatures 个 uint64（按训练文件的列顺序）
+//   op = 1 评分:   响应 uint32 status, uint32 count, count 个 double
+//   op = 2 统计:   响应 uint32 status, uint32 7, 7 个 uint64:
+//                  队列深度, 请求数, 批次数, 平均延迟(us), 最大延迟(us), p50上界(us), p99上界(us)
+//   op = 3 特征表: 响应 uint32 status, uint32 numFeatures, 每个特征为 uint32 长度 + 名称
+//   op = 4 重新训练: 在后台重新读取训练文件并训练，完成后原子替换模型，评分不中断。
+//                  响应 uint32 status, uint32 0；已有训练在进行时 status 为 2
+// status 为 0 表示成功；请求格式错误时返回非零 status 并关闭连接。
+// 同时服务的连接数达到上限时，新的连接留在监听队列中，直到有连接关闭。
+
+#include "IsolationForest.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace IsolationForest;
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	enum
+	{
+		OP_SCORE = 1,
+		OP_STATS = 2,
+		OP_SCHEMA = 3,
+		OP_RETRAIN = 4
+	};
+
+	enum
+	{
+		STATUS_OK = 0,
+		STATUS_BAD_REQUEST = 1,
+		STATUS_BUSY = 2
+	};
+
+	const uint32_t MAX_ROWS_PER_REQUEST = 65536;
+	const size_t NUM_LATENCY_BUCKETS = 40;
+
+	// 等待评分的请求，由连接线程创建并等待批处理线程完成。
+	struct PendingRequest
+	{
+		const uint64_t* values;
+		size_t numRows;
+		double* scores;
+		Clock::time_point enqueued;
+		bool done;
+	};
+
+	// 请求延迟统计，直方图的第i个桶记录 [2^(i-1), 2^i) 微秒的请求。
+	struct LatencyStats
+	{
+		LatencyStats() : requests(0), batches(0), totalMicros(0), maxMicros(0) { memset(buckets, 0, sizeof(buckets)); };
+
+		uint64_t requests;
+		uint64_t batches;
+		uint64_t totalMicros;
+		uint64_t maxMicros;
+		uint64_t buckets[NUM_LATENCY_BUCKETS];
+
+		void Record(uint64_t micros)
+		{
+			size_t bucket = 0;
+			while (bucket + 1 < NUM_LATENCY_BUCKETS && (micros >> bucket) != 0)
+			{
+				++bucket;
+			}
+			++buckets[bucket];
+			++requests;
+			totalMicros += micros;
+			maxMicros = std::max(maxMicros, micros);
+		}
+
+		uint64_t Percentile(double fraction) const
+		{
+			uint64_t target = (uint64_t)ceil(fraction * (double)requests);
+			uint64_t seen = 0;
+			for (size_t bucket = 0; bucket < NUM_LATENCY_BUCKETS; ++bucket)
+			{
+				seen += buckets[bucket];
+				if (seen >= target && seen > 0)
+				{
+					return (uint64_t)1 << bucket;
+				}
+			}
+			return 0;
+		}
+	};
+
+	// 一个客户端连接及服务它的线程。套接字由 Run 在回收线程时关闭。
+	struct Connection
+	{
+		Connection(int socket) : socket(socket), finished(false) {};
+
+		int socket;
+		bool finished;
+		std::thread thread;
+	};
+
+	typedef std::function<ForestConstPtr()> TrainFunction;
+
+	class ScoringServer
+	{
+	public:
+		ScoringServer(ForestHandle& forest, const std::vector<std::string>& featureNames, TrainFunction train, size_t maxBatch, uint32_t maxWaitMicros, size_t maxConnections) :
+			m_forest(forest),
+			m_featureNames(featureNames),
+			m_train(train),
+			m_maxBatch(maxBatch),
+			m_maxWait(maxWaitMicros),
+			m_maxConnections(maxConnections),
+			m_stopping(false),
+			m_training(false)
+		{
+		}
+
+		// 接受连接直到 accept 出现不可恢复的错误。返回前关闭所有连接并等待所有线程结束。
+		void Run(int listenSocket)
+		{
+			std::thread batcher(&ScoringServer::BatchLoop, this);
+			std::chrono::milliseconds backoff(0);
+
+			while (true)
+			{
+				WaitForConnectionSlot();
+
+				int client = accept(listenSocket, NULL, NULL);
+				if (client < 0)
+				{
+					if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+					{
+						continue;
+					}
+					if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+					{
+						// 资源暂时不足，等待现有连接关闭后再试。
+						perror("accept");
+						backoff = std::min(std::max(backoff * 2, std::chrono::milliseconds(10)), std::chrono::milliseconds(1000));
+						std::this_thread::sleep_for(backoff);
+						continue;
+					}
+					perror("accept");
+					break;
+				}
+				backoff = std::chrono::milliseconds(0);
+
+				std::lock_guard<std::mutex> lock(m_connectionMutex);
+				m_connections.emplace_back(client);
+				Connection& connection = m_connections.back();
+				connection.thread = std::thread(&ScoringServer::ServeConnection, this, &connection);
+			}
+
+			Shutdown(batcher);
+		}
+
+	private:
+		ForestHandle& m_forest;
+		std::vector<std::string> m_featureNames;
+		TrainFunction m_train; // 重新训练一个森林
+		size_t m_maxBatch; // 每批最多的样本行数
+		std::chrono::microseconds m_maxWait; // 第一个请求入队后最多等待多久再评分
+		size_t m_maxConnections; // 同时服务的连接数上限
+
+		std::mutex m_mutex;
+		std::condition_variable m_queueChanged; // 有新请求入队，或批处理线程应当退出
+		std::condition_variable m_requestsDone; // 有请求评分完成
+		std::deque<PendingRequest*> m_queue;
+		LatencyStats m_stats;
+		bool m_stopping; // 批处理线程处理完队列后退出
+
+		std::mutex m_connectionMutex;
+		std::condition_variable m_connectionFinished;
+		std::list<Connection> m_connections;
+
+		std::mutex m_retrainMutex;
+		std::thread m_retrainThread;
+		std::atomic<bool> m_training; // 是否有后台训练在进行
+
+		// 回收已结束的连接线程，连接数达到上限时等待有连接结束。
+		void WaitForConnectionSlot()
+		{
+			std::unique_lock<std::mutex> lock(m_connectionMutex);
+			while (true)
+			{
+				for (std::list<Connection>::iterator iter = m_connections.begin(); iter != m_connections.end();)
+				{
+					if ((*iter).finished)
+					{
+						(*iter).thread.join();
+						close((*iter).socket);
+						iter = m_connections.erase(iter);
+					}
+					else
+					{
+						++iter;
+					}
+				}
+				if (m_connections.size() < m_maxConnections)
+				{
+					return;
+				}
+				m_connectionFinished.wait(lock);
+			}
+		}
+
+		// 关闭所有连接的读写使连接线程退出，等待它们、批处理线程和后台训练结束。
+		void Shutdown(std::thread& batcher)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_connectionMutex);
+				for (std::list<Connection>::iterator iter = m_connections.begin(); iter != m_connections.end(); ++iter)
+				{
+					shutdown((*iter).socket, SHUT_RDWR);
+				}
+			}
+			for (std::list<Connection>::iterator iter = m_connections.begin(); iter != m_connections.end(); ++iter)
+			{
+				(*iter).thread.join();
+				close((*iter).socket);
+			}
+			m_connections.clear();
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stopping = true;
+			}
+			m_queueChanged.notify_all();
+			batcher.join();
+
+			std::lock_guard<std::mutex> lock(m_retrainMutex);
+			if (m_retrainThread.joinable())
+			{
+				m_retrainThread.join();
+			}
+		}
+
+		// 把一批请求合并成一个矩阵评分。
+		void BatchLoop()
+		{
+			size_t numFeatures = m_featureNames.size();
+			std::vector<PendingRequest*> batch;
+			std::vector<uint64_t> values;
+			std::vector<double> scores;
+
+			while (true)
+			{
+				batch.clear();
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_queueChanged.wait(lock, [this] { return !m_queue.empty() || m_stopping; });
+					if (m_queue.empty())
+					{
+						return;
+					}
+
+					// 等到批次已满或最早的请求等待超时。
+					Clock::time_point deadline = m_queue.front()->enqueued + m_maxWait;
+					while (QueuedRows() < m_maxBatch && Clock::now() < deadline)
+					{
+						m_queueChanged.wait_until(lock, deadline);
+					}
+
+					size_t rows = 0;
+					while (!m_queue.empty() && (batch.empty() || rows + m_queue.front()->numRows <= m_maxBatch))
+					{
+						rows += m_queue.front()->numRows;
+						batch.push_back(m_queue.front());
+						m_queue.pop_front();
+					}
+				}
+
+				values.clear();
+				for (size_t i = 0; i < batch.size(); ++i)
+				{
+					values.insert(values.end(), batch[i]->values, batch[i]->values + batch[i]->numRows * numFeatures);
+				}
+				scores.resize(values.size() / std::max(numFeatures, (size_t)1));
+				m_forest.Score(m_featureNames, values.data(), scores.size(), scores.data());
+
+				Clock::time_point now = Clock::now();
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					size_t offset = 0;
+					for (size_t i = 0; i < batch.size(); ++i)
+					{
+						std::copy(scores.begin() + offset, scores.begin() + offset + batch[i]->numRows, batch[i]->scores);
+						offset += batch[i]->numRows;
+						batch[i]->done = true;
+						m_stats.Record((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - batch[i]->enqueued).count());
+					}
+					++m_stats.batches;
+				}
+				m_requestsDone.notify_all();
+			}
+		}
+
+		size_t QueuedRows() const
+		{
+			size_t rows = 0;
+			for (size_t i = 0; i < m_queue.size(); ++i)
+			{
+				rows += m_queue[i]->numRows;
+			}
+			return rows;
+		}
+
+		void Score(const uint64_t* values, size_t numRows, double* scores)
+		{
+			PendingRequest request;
+			request.values = values;
+			request.numRows = numRows;
+			request.scores = scores;
+			request.enqueued = Clock::now();
+			request.done = false;
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_queue.push_back(&request);
+			m_queueChanged.notify_one();
+			m_requestsDone.wait(lock, [&request] { return request.done; });
+		}
+
+		void ServeConnection(Connection* connection)
+		{
+			int client = connection->socket;
+			std::vector<uint64_t> values;
+			std::vector<double> scores;
+			std::vector<char> response;
+
+			uint32_t header[2];
+			while (ReadAll(client, header, sizeof(header)))
+			{
+				uint32_t op = header[0];
+				uint32_t count = header[1];
+				response.clear();
+
+				if (op == OP_SCORE && count <= MAX_ROWS_PER_REQUEST)
+				{
+					values.resize((size_t)count * m_featureNames.size());
+					if (!ReadAll(client, values.data(), values.size() * sizeof(uint64_t)))
+					{
+						break;
+					}
+					scores.resize(count);
+					if (count > 0)
+					{
+						Score(values.data(), count, scores.data());
+					}
+					AppendHeader(response, STATUS_OK, count);
+					Append(response, scores.data(), scores.size() * sizeof(double));
+				}
+				else if (op == OP_STATS)
+				{
+					uint64_t stats[7];
+					{
+						std::lock_guard<std::mutex> lock(m_mutex);
+						stats[0] = m_queue.size();
+						stats[1] = m_stats.requests;
+						stats[2] = m_stats.batches;
+						stats[3] = m_stats.requests ? m_stats.totalMicros / m_stats.requests : 0;
+						stats[4] = m_stats.maxMicros;
+						stats[5] = m_stats.Percentile(0.5);
+						stats[6] = m_stats.Percentile(0.99);
+					}
+					AppendHeader(response, STATUS_OK, 7);
+					Append(response, stats, sizeof(stats));
+				}
+				else if (op == OP_RETRAIN)
+				{
+					bool expected = false;
+					if (m_training.compare_exchange_strong(expected, true))
+					{
+						// 上一次训练已经结束（m_training 为 false），回收它的线程。
+						std::lock_guard<std::mutex> lock(m_retrainMutex);
+						if (m_retrainThread.joinable())
+						{
+							m_retrainThread.join();
+						}
+						m_retrainThread = std::thread(&ScoringServer::Retrain, this);
+						AppendHeader(response, STATUS_OK, 0);
+					}
+					else
+					{
+						AppendHeader(response, STATUS_BUSY, 0);
+					}
+				}
+				else if (op == OP_SCHEMA)
+				{
+					AppendHeader(response, STATUS_OK, (uint32_t)m_featureNames.size());
+					for (size_t i = 0; i < m_featureNames.size(); ++i)
+					{
+						uint32_t length = (uint32_t)m_featureNames[i].size();
+						Append(response, &length, sizeof(length));
+						Append(response, m_featureNames[i].data(), length);
+					}
+				}
+				else
+				{
+					AppendHeader(response, STATUS_BAD_REQUEST, 0);
+					WriteAll(client, response.data(), response.size());
+					break;
+				}
+
+				if (!WriteAll(client, response.data(), response.size()))
+				{
+					break;
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(m_connectionMutex);
+			connection->finished = true;
+			m_connectionFinished.notify_one();
+		}
+
+		// 在后台训练新森林并发布。评分线程继续使用旧森林直到发布完成。
+		void Retrain()
+		{
+			ForestConstPtr forest = m_train();
+			if (forest)
+			{
+				uint64_t version = m_forest.Publish(forest);
+				std::cout << "Published model version " << version << " with " << forest->NumTrees() << " trees." << std::endl;
+			}
+			else
+			{
+				std::cerr << "Retraining failed, keeping the current model." << std::endl;
+			}
+			m_training = false;
+		}
+
+		static void Append(std::vector<char>& buffer, const void* data, size_t size)
+		{
+			const char* bytes = (const char*)data;
+			buffer.insert(buffer.end(), bytes, bytes + size);
+		}
+
+		static void AppendHeader(std::vector<char>& buffer, uint32_t status, uint32_t count)
+		{
+			uint32_t header[2] = { status, count };
+			Append(buffer, header, sizeof(header));
+		}
+
+		static bool ReadAll(int fd, void* data, size_t size)
+		{
+			char* bytes = (char*)data;
+			while (size > 0)
+			{
+				ssize_t n = read(fd, bytes, size);
+				if (n < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				if (n <= 0)
+				{
+					return false;
+				}
+				bytes += n;
+				size -= (size_t)n;
+			}
+			return true;
+		}
+
+		static bool WriteAll(int fd, const void* data, size_t size)
+		{
+			const char* bytes = (const char*)data;
+			while (size > 0)
+			{
+				ssize_t n = write(fd, bytes, size);
+				if (n < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				if (n <= 0)
+				{
+					return false;
+				}
+				bytes += n;
+				size -= (size_t)n;
+			}
+			return true;
+		}
+	};
+
+	// 读取训练文件并加入森林，返回列名。
+	bool LoadTrainingFile(const char* path, Forest& forest, std::vector<std::string>& featureNames)
+	{
+		std::ifstream in(path);
+		if (!in.is_open())
+		{
+			return false;
+		}
+
+		std::string line;
+		if (!std::getline(in, line))
+		{
+			return false;
+		}
+		split(line, "\t", featureNames);
+		if (!featureNames.empty() && !featureNames.back().empty() && featureNames.back().back() == '\r')
+		{
+			featureNames.back().erase(featureNames.back().size() - 1);
+		}
+
+		const size_t rowsPerChunk = 4096;
+		std::vector<uint64_t> values;
+		std::vector<std::string> fields;
+		while (std::getline(in, line))
+		{
+			split(line, "\t", fields);
+			if (fields.size() < featureNames.size())
+			{
+				continue;
+			}
+			for (size_t i = 0; i < featureNames.size(); ++i)
+			{
+				values.push_back(strtoull(fields[i].c_str(), NULL, 10));
+			}
+			if (values.size() >= rowsPerChunk * featureNames.size())
+			{
+				forest.AddSamples(featureNames, values.data(), values.size() / featureNames.size());
+				values.clear();
+			}
+		}
+		if (!values.empty())
+		{
+			forest.AddSamples(featureNames, values.data(), values.size() / featureNames.size());
+		}
+		return !featureNames.empty();
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+	if (argc < 3)
+	{
+		std::cerr << "usage: " << argv[0] << " <socket> <training file> [--trees N] [--depth D] [--max-batch B] [--max-wait-us U] [--max-connections C]" << std::endl;
+		return 1;
+	}
+
+	const char* socketPath = argv[1];
+	const char* trainingPath = argv[2];
+	uint32_t numTrees = 100;
+	uint32_t subSamplingSize = 256;
+	size_t maxBatch = 256;
+	uint32_t maxWaitMicros = 200;
+	size_t maxConnections = 256;
+
+	for (int i = 3; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "--trees") == 0)
+			numTrees = (uint32_t)atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--depth") == 0)
+			subSamplingSize = (uint32_t)atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--max-batch") == 0)
+			maxBatch = (size_t)std::max(atoi(argv[i + 1]), 1);
+		else if (strcmp(argv[i], "--max-wait-us") == 0)
+			maxWaitMicros = (uint32_t)atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--max-connections") == 0)
+			maxConnections = (size_t)std::max(atoi(argv[i + 1]), 1);
+	}
+
+	// 重新训练时列必须与第一次训练时一致，否则客户端发送的矩阵无法解释。
+	std::vector<std::string> featureNames;
+	TrainFunction train = [=, &featureNames]() -> ForestConstPtr
+	{
+		std::shared_ptr<Forest> forest(new Forest(numTrees, subSamplingSize));
+		std::vector<std::string> names;
+		if (!LoadTrainingFile(trainingPath, *forest, names) || (!featureNames.empty() && names != featureNames))
+		{
+			std::cerr << "Failed to read training file " << trainingPath << std::endl;
+			return ForestConstPtr();
+		}
+		if (featureNames.empty())
+		{
+			featureNames = names;
+		}
+		forest->Create();
+		return forest;
+	};
+
+	ForestConstPtr initialForest = train();
+	if (!initialForest)
+	{
+		return 1;
+	}
+	ForestHandle forest(initialForest);
+	initialForest.reset();
+	std::cout << "Created " << forest.Acquire()->NumTrees() << " trees over " << featureNames.size() << " features." << std::endl;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenSocket < 0)
+	{
+		perror("socket");
+		return 1;
+	}
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(address.sun_path))
+	{
+		std::cerr << "Socket path is too long." << std::endl;
+		return 1;
+	}
+	strcpy(address.sun_path, socketPath);
+	unlink(socketPath);
+
+	if (bind(listenSocket, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listenSocket, 128) != 0)
+	{
+		perror("bind");
+		return 1;
+	}
+
+	ScoringServer server(forest, featureNames, train, maxBatch, maxWaitMicros, maxConnections);
+	server.Run(listenSocket);
+
+	close(listenSocket);
+	unlink(socketPath);
+	return 0;
+}
@@ -0,0 +1,206 @@
+// 多进程分片训练工具（POSIX）。每个进程创建森林中互不相交的一段树并保存，协调者把它们合并成一个森林。
+// 第i棵树的随机数只由种子和i决定，所以合并后的森林与单个进程用同样的种子创建的森林完全相同。
+//
+// 用法:
+//   ShardTraining train <数据集> <种子> <第一棵树> <树的数量> <输出文件> [--subsample K]
+//       用数据集创建 [第一棵树, 第一棵树 + 树的数量) 的树并保存。
+//   ShardTraining merge <输出文件> <分片文件>...
+//       按给定的顺序合并分片。
+//   ShardTraining selftest <数据集> [--shards S] [--trees N] [--subsample K] [--seed X]
+//       在本机启动S个进程各自训练一个分片，合并后与单进程训练的森林比较数据集中每一行的分数，
+//       分数完全相同时返回0。
+// --subsample 是构造 Forest 时的 subSamplingSize（也是树的深度上限），默认256，所有分片必须相同。
+// 数据集为列式文件（见 ColumnarDataset），由各进程内存映射共享。各进程也可以使用各自的本地数据集，
+// 此时合并结果是各分片数据上训练的树的集合。
+
+#include "IsolationForest.h"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace IsolationForest;
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	double ElapsedMillis(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	bool TrainShard(const std::string& datasetPath, uint64_t seed, uint32_t firstTree, uint32_t numTrees, Forest& forest)
+	{
+		std::unique_ptr<ColumnarDataset> dataset(ColumnarDataset::Open(datasetPath));
+		if (!dataset)
+		{
+			std::cerr << "Failed to open dataset " << datasetPath << std::endl;
+			return false;
+		}
+		forest.AddDataset(*dataset);
+		forest.GrowShard(seed, firstTree, numTrees);
+		return true;
+	}
+
+	// 按行存放数据集，用于批量评分。
+	void DatasetRows(const ColumnarDataset& dataset, std::vector<std::string>& featureNames, std::vector<uint64_t>& values)
+	{
+		size_t numColumns = dataset.NumColumns();
+		featureNames.clear();
+		for (size_t column = 0; column < numColumns; ++column)
+		{
+			featureNames.push_back(dataset.ColumnName(column));
+		}
+		values.resize(dataset.NumRows() * numColumns);
+		for (size_t column = 0; column < numColumns; ++column)
+		{
+			const uint64_t* columnValues = dataset.Column(column);
+			for (size_t row = 0; row < dataset.NumRows(); ++row)
+			{
+				values[row * numColumns + column] = columnValues[row];
+			}
+		}
+	}
+
+	int SelfTest(const std::string& datasetPath, uint32_t numShards, uint32_t numTrees, uint32_t subSamplingSize, uint64_t seed)
+	{
+		numShards = std::max(std::min(numShards, numTrees), (uint32_t)1);
+
+		// 每个子进程训练一段树并保存到临时文件。
+		Clock::time_point start = Clock::now();
+		std::vector<std::string> shardPaths;
+		std::vector<pid_t> children;
+		for (uint32_t shard = 0; shard < numShards; ++shard)
+		{
+			uint32_t firstTree = (uint32_t)((uint64_t)numTrees * shard / numShards);
+			uint32_t lastTree = (uint32_t)((uint64_t)numTrees * (shard + 1) / numShards);
+			shardPaths.push_back("/tmp/ShardTraining." + std::to_string(getpid()) + "." + std::to_string(shard) + ".forest");
+
+			pid_t child = fork();
+			if (child < 0)
+			{
+				perror("fork");
+				return 1;
+			}
+			if (child == 0)
+			{
+				Forest forest(0, subSamplingSize);
+				bool ok = TrainShard(datasetPath, seed, firstTree, lastTree - firstTree, forest) && forest.Save(shardPaths[shard]);
+				_exit(ok ? 0 : 1);
+			}
+			children.push_back(child);
+		}
+
+		bool shardsOk = true;
+		for (size_t i = 0; i < children.size(); ++i)
+		{
+			int status = 0;
+			shardsOk = waitpid(children[i], &status, 0) == children[i] && WIFEXITED(status) && WEXITSTATUS(status) == 0 && shardsOk;
+		}
+
+		Forest merged;
+		for (size_t shard = 0; shard < shardPaths.size(); ++shard)
+		{
+			Forest shardForest;
+			shardsOk = shardsOk && shardForest.Load(shardPaths[shard]) && merged.Merge(shardForest);
+			unlink(shardPaths[shard].c_str());
+		}
+		if (!shardsOk)
+		{
+			std::cerr << "Shard training failed." << std::endl;
+			return 1;
+		}
+		double shardedMillis = ElapsedMillis(start);
+
+		// 单进程用同样的种子创建全部的树。
+		start = Clock::now();
+		Forest single(0, subSamplingSize);
+		if (!TrainShard(datasetPath, seed, 0, numTrees, single))
+		{
+			return 1;
+		}
+		double singleMillis = ElapsedMillis(start);
+
+		std::unique_ptr<ColumnarDataset> dataset(ColumnarDataset::Open(datasetPath));
+		std::vector<std::string> featureNames;
+		std::vector<uint64_t> values;
+		DatasetRows(*dataset, featureNames, values);
+
+		std::vector<double> mergedScores(dataset->NumRows());
+		std::vector<double> singleScores(dataset->NumRows());
+		merged.Score(featureNames, values.data(), dataset->NumRows(), mergedScores.data());
+		single.Score(featureNames, values.data(), dataset->NumRows(), singleScores.data());
+
+		size_t mismatches = 0;
+		for (size_t row = 0; row < dataset->NumRows(); ++row)
+		{
+			mismatches += (mergedScores[row] != singleScores[row]) ? 1 : 0;
+		}
+
+		std::cout << numShards << " shards: " << merged.NumTrees() << " trees in " << shardedMillis << " ms, single process: "
+			<< single.NumTrees() << " trees in " << singleMillis << " ms, " << mismatches << " of " << dataset->NumRows() << " scores differ." << std::endl;
+		return (mismatches == 0 && merged.NumTrees() == single.NumTrees()) ? 0 : 1;
+	}
+
+	uint32_t OptionValue(int argc, const char* argv[], int first, const char* name, uint32_t defaultValue)
+	{
+		for (int i = first; i + 1 < argc; i += 2)
+		{
+			if (strcmp(argv[i], name) == 0)
+			{
+				return (uint32_t)strtoul(argv[i + 1], NULL, 10);
+			}
+		}
+		return defaultValue;
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+	std::string mode = argc > 1 ? argv[1] : "";
+
+	if (mode == "train" && argc >= 7)
+	{
+		Forest forest(0, OptionValue(argc, argv, 7, "--subsample", 256));
+		if (!TrainShard(argv[2], strtoull(argv[3], NULL, 10), (uint32_t)strtoul(argv[4], NULL, 10), (uint32_t)strtoul(argv[5], NULL, 10), forest) || !forest.Save(argv[6]))
+		{
+			std::cerr << "Failed to train shard." << std::endl;
+			return 1;
+		}
+		std::cout << "Saved " << forest.NumTrees() << " trees to " << argv[6] << std::endl;
+		return 0;
+	}
+	if (mode == "merge" && argc >= 4)
+	{
+		Forest merged;
+		for (int i = 3; i < argc; ++i)
+		{
+			Forest shard;
+			if (!shard.Load(argv[i]) || !merged.Merge(shard))
+			{
+				std::cerr << "Failed to merge " << argv[i] << std::endl;
+				return 1;
+			}
+		}
+		if (!merged.Save(argv[2]))
+		{
+			std::cerr << "Failed to save " << argv[2] << std::endl;
+			return 1;
+		}
+		std::cout << "Merged " << merged.NumTrees() << " trees into " << argv[2] << std::endl;
+		return 0;
+	}
+	if (mode == "selftest" && argc >= 3)
+	{
+		return SelfTest(argv[2], OptionValue(argc, argv, 3, "--shards", 4), OptionValue(argc, argv, 3, "--trees", 100),
+			OptionValue(argc, argv, 3, "--subsample", 256), OptionValue(argc, argv, 3, "--seed", 1));
+	}
+
+	std::cerr << "usage: " << argv[0] << " train <dataset> <seed> <first tree> <num trees> <output> [--subsample K]" << std::endl;
+	std::cerr << "       " << argv[0] << " merge <output> <shard>..." << std::endl;
+	std::cerr << "       " << argv[0] << " selftest <dataset> [--shards S] [--trees N] [--subsample K] [--seed X]" << std::endl;
+	return 1;
+}
@@ -4,6 +4,7 @@
 #include <inttypes.h>
 #include <iostream>
 #include <fstream>
+#include <condition_variable>
 
 
 
@@ -11,37 +12,159 @@
 using namespace IsolationForest;
 
 
-void CalculationResults(const char* pfpath,/*const char* out_path,const char* all_outpath,*/string &result,string filename)
+// ˮ߸׶֮нСʱߵȴرպȡʣ
+template <typename T>
+class BoundedQueue
 {
-	FeaturePtrList features;
-	Forest forest(100, 256);
-	Sample sample(filename);
-	FILE *fp = fopen(pfpath, "rb");
+public:
+	explicit BoundedQueue(size_t capacity) : m_capacity(capacity), m_closed(false) {};
+
+	void Push(T item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_notFull.wait(lock, [this] { return m_items.size() < m_capacity; });
+		m_items.push(std::move(item));
+		m_notEmpty.notify_one();
+	}
+
+	bool Pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_notEmpty.wait(lock, [this] { return !m_items.empty() || m_closed; });
+		if (m_items.empty())
+		{
+			return false;
+		}
+		item = std::move(m_items.front());
+		m_items.pop();
+		m_notFull.notify_one();
+		return true;
+	}
+
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = true;
+		m_notEmpty.notify_all();
+	}
+
+private:
+	size_t m_capacity;
+	bool m_closed;
+	std::queue<T> m_items;
+	std::mutex m_mutex;
+	std::condition_variable m_notFull;
+	std::condition_variable m_notEmpty;
+};
+
+// ͬʱˮеļдһļµļڴļ޹ء
+class InFlightLimit
+{
+public:
+	explicit InFlightLimit(size_t limit) : m_available(limit) {};
+
+	void Acquire()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_released.wait(lock, [this] { return m_available > 0; });
+		--m_available;
+	}
+
+	void Release()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_available;
+		m_released.notify_one();
+	}
+
+private:
+	size_t m_available;
+	std::mutex m_mutex;
+	std::condition_variable m_released;
+};
+
+struct FileJob
+{
+	size_t sequence; // ˳
+	std::string name;
+	std::string path;
+	std::string content; // ļ
+	std::vector<uint64_t> values; // дŵֵ
+	std::string result; // дļ
+};
+
+typedef std::unique_ptr<FileJob> FileJobPtr;
+
+static const char* FEATURE_NAMES[] = { "_DY_price", "totalCount", "goodsQualityScore" };
+static const size_t NUM_FEATURES = 3;
+
+// һζļ
+void ReadFile(FileJob& job)
+{
+	FILE *fp = fopen(job.path.c_str(), "rb");
 	if (!fp)
 	{
-		printf("fopen %s fail!\n", pfpath);
-		result = "fopen fail!";
+		printf("fopen %s fail!\n", job.path.c_str());
 		return;
 	}
-	char buff[1024] = "";
-	while (fgets(buff, sizeof(buff), fp))
+	char buff[1 << 16];
+	size_t length;
+	while ((length = fread(buff, 1, sizeof(buff), fp)) > 0)
 	{
-		std::vector<std::string> out;
-		split(buff, "\t", out);
-		features.push_back(new Feature("_DY_price", atoi(out[3].c_str())));
-		features.push_back(new Feature("totalCount", atoi(out[2].c_str())));
-		features.push_back(new Feature("goodsQualityScore", atoi(out[4].c_str())));
-		sample.AddFeatures(features);
-		forest.AddSample(sample);
+		job.content.append(buff, length);
 	}
 	fclose(fp);
-	// Create the isolation forest.
+}
+
+// ÿаƱУȡ۸С
+void ParseFile(FileJob& job)
+{
+	std::vector<std::string> out;
+	size_t begin = 0;
+	while (begin < job.content.size())
+	{
+		size_t end = job.content.find('\n', begin);
+		if (end == std::string::npos)
+		{
+			end = job.content.size();
+		}
+		split(job.content.substr(begin, end - begin), "\t", out);
+		begin = end + 1;
+		if (out.size() < 5)
+		{
+			continue;
+		}
+		job.values.push_back(atoi(out[3].c_str()));
+		job.values.push_back(atoi(out[2].c_str()));
+		job.values.push_back(atoi(out[4].c_str()));
+	}
+	std::string().swap(job.content);
+}
+
+// ѵ֣ÿļѵһɭ֣Ȼļеÿһ֡
+void CalculationResults(FileJob& job)
+{
+	std::vector<std::string> featureNames(FEATURE_NAMES, FEATURE_NAMES + NUM_FEATURES);
+	size_t numSamples = job.values.size() / NUM_FEATURES;
+	if (numSamples == 0)
+	{
+		return;
+	}
+
+	Forest forest(100, 256);
+	forest.AddSamples(featureNames, job.values.data(), numSamples);
 	forest.Create();
 
-	double score = forest.Score(sample);
-	std::cout << "Outlier test sample " << score << std::endl;
+	std::vector<double> scores(numSamples);
+	forest.Score(featureNames, job.values.data(), numSamples, scores.data());
 
-	return;
+	char line[128];
+	for (size_t i = 0; i < numSamples; ++i)
+	{
+		snprintf(line, sizeof(line), "%s\t%u\t%f\n", job.name.c_str(), (unsigned int)i, scores[i]);
+		job.result.append(line);
+	}
+	std::vector<uint64_t>().swap(job.values);
 }
 
 
@@ -50,34 +173,125 @@ int main(int argc, const char * argv[])
 {
 	std::vector<std::string> files;
 	std::vector<std::string> name;
-	std::map<int, std::string> mapfile;
-	std::string result;
 	const char* dir = "C:\\Users\\suning\\PycharmProjects\\data\\train";
 	const char* out_path = "C:\\Users\\suning\\PycharmProjects\\data\\trainout\\out1.csv";
-	std::fstream f_out;
-	f_out.open(out_path, ios::app);
+	if (argc > 2)
+	{
+		dir = argv[1];
+		out_path = argv[2];
+	}
+	FILE* f_out = fopen(out_path, "ab");
+	if (!f_out)
+	{
+		printf("fopen %s fail!\n", out_path);
+		return 1;
+	}
 	traverseDir(dir, files, name);
 
-
+	// ļ˳ԭ map һ£Ҫڴбн
+	std::vector<FileJob> order;
 	for (size_t i = 0; i < files.size(); i++)
 	{
 		string temp = name[i];
-		temp = temp.erase(temp.find("."));
-		const char * p = files[i].data();
-		CalculationResults(p, result,temp);
-		if (result.size() != 0)
+		if (temp.find(".") != std::string::npos)
+		{
+			temp = temp.erase(temp.find("."));
+		}
+		FileJob job;
+		job.name = temp;
+		job.path = files[i];
+		order.push_back(job);
+	}
+	std::stable_sort(order.begin(), order.end(), [](const FileJob& a, const FileJob& b) { return atoi(a.name.c_str()) < atoi(b.name.c_str()); });
+
+	//  ->  -> ѵ֣̣߳-> д׶֮ΪнС
+	size_t numWorkers = std::max((size_t)std::thread::hardware_concurrency(), (size_t)2) - 1;
+	InFlightLimit inFlight(2 * numWorkers + 4);
+	BoundedQueue<FileJobPtr> readQueue(2);
+	BoundedQueue<FileJobPtr> parseQueue(numWorkers + 1);
+	BoundedQueue<FileJobPtr> writeQueue(numWorkers + 1);
+
+	std::thread reader([&]
+	{
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			inFlight.Acquire();
+			FileJobPtr job(new FileJob(order[i]));
+			job->sequence = i;
+			ReadFile(*job);
+			readQueue.Push(std::move(job));
+		}
+		readQueue.Close();
+	});
+
+	std::thread parser([&]
+	{
+		FileJobPtr job;
+		while (readQueue.Pop(job))
+		{
+			ParseFile(*job);
+			parseQueue.Push(std::move(job));
+		}
+		parseQueue.Close();
+	});
+
+	std::vector<std::thread> workers;
+	std::atomic<size_t> runningWorkers(numWorkers);
+	for (size_t i = 0; i < numWorkers; ++i)
+	{
+		workers.push_back(std::thread([&]
+		{
+			FileJobPtr job;
+			while (parseQueue.Pop(job))
+			{
+				CalculationResults(*job);
+				writeQueue.Push(std::move(job));
+			}
+			if (--runningWorkers == 0)
+			{
+				writeQueue.Close();
+			}
+		}));
+	}
+
+	// д˳дܵ1MBдһļ
+	std::map<size_t, FileJobPtr> pending;
+	std::string buffer;
+	size_t nextSequence = 0;
+	FileJobPtr job;
+	while (writeQueue.Pop(job))
+	{
+		pending[job->sequence] = std::move(job);
+		while (!pending.empty() && pending.begin()->first == nextSequence)
 		{
-			cout << temp << ":\tsuccess" << endl;
-			mapfile[atoi(temp.c_str())] = result;
+			FileJob& done = *pending.begin()->second;
+			if (done.result.size() != 0)
+			{
+				cout << done.name << ":\tsuccess" << endl;
+				buffer.append(done.result);
+			}
+			if (buffer.size() >= (1 << 20))
+			{
+				fwrite(buffer.data(), 1, buffer.size(), f_out);
+				buffer.clear();
+			}
+			pending.erase(pending.begin());
+			++nextSequence;
+			inFlight.Release();
 		}
 	}
+	fwrite(buffer.data(), 1, buffer.size(), f_out);
+	fclose(f_out);
 
-	for (auto i = mapfile.begin(); i != mapfile.end(); i++)
+	reader.join();
+	parser.join();
+	for (size_t i = 0; i < workers.size(); ++i)
 	{
-		f_out << i->second;
+		workers[i].join();
 	}
-	f_out.close();
 
+#ifdef _WIN32
 	system("pause");
+#endif
 	return 0;
 }
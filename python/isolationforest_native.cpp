@@ -0,0 +1,464 @@
+// Python binding for the C++ engine, built on the C API in IsolationForestC.h.
+// Sample matrices are taken through the buffer protocol (for example a C-contiguous
+// numpy.uint64 array of shape (num_samples, num_features)) and are never copied.
+// Training and scoring release the GIL.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "IsolationForestC.h"
+
+/// Shared/exclusive lock around the engine. Scoring and statistics only read the forest,
+/// so any number of them may run at once; training and re-initialization take it
+/// exclusively. A waiting writer blocks new readers so a steady stream of scoring
+/// calls cannot starve it.
+class EngineLock
+{
+public:
+	EngineLock() : m_readers(0), m_waitingWriters(0), m_writer(false) {}
+
+	void LockShared()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_writer || m_waitingWriters > 0)
+		{
+			m_changed.wait(lock);
+		}
+		++m_readers;
+	}
+
+	void UnlockShared()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (--m_readers == 0)
+		{
+			m_changed.notify_all();
+		}
+	}
+
+	void Lock()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		++m_waitingWriters;
+		while (m_writer || m_readers > 0)
+		{
+			m_changed.wait(lock);
+		}
+		--m_waitingWriters;
+		m_writer = true;
+	}
+
+	void Unlock()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_writer = false;
+		m_changed.notify_all();
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+	size_t m_readers;
+	size_t m_waitingWriters;
+	bool m_writer;
+};
+
+typedef struct
+{
+	PyObject_HEAD
+	IF_Forest* forest;
+	EngineLock* lock; // Guards the engine once the GIL is released: shared for scoring, exclusive otherwise
+} ForestObject;
+
+/// Holds the feature names for the duration of an engine call.
+struct FeatureNames
+{
+	std::vector<std::string> strings;
+	std::vector<const char*> pointers;
+};
+
+static bool GetFeatureNames(PyObject* sequence, FeatureNames& names)
+{
+	PyObject* fast = PySequence_Fast(sequence, "feature_names must be a sequence of str");
+	if (!fast)
+	{
+		return false;
+	}
+
+	Py_ssize_t count = PySequence_Fast_GET_SIZE(fast);
+	names.strings.reserve(count);
+	for (Py_ssize_t i = 0; i < count; ++i)
+	{
+		const char* name = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(fast, i));
+		if (!name)
+		{
+			Py_DECREF(fast);
+			return false;
+		}
+		names.strings.push_back(name);
+	}
+	Py_DECREF(fast);
+
+	for (size_t i = 0; i < names.strings.size(); ++i)
+	{
+		names.pointers.push_back(names.strings[i].c_str());
+	}
+	return true;
+}
+
+/// Accepts only 8 byte unsigned integers, which is what numpy.uint64 exports.
+static bool IsUInt64Format(const char* format)
+{
+	if (!format)
+	{
+		return false;
+	}
+	if (format[0] == '<' || format[0] == '=' || format[0] == '@')
+	{
+		++format;
+	}
+	return strcmp(format, "Q") == 0 || strcmp(format, "L") == 0;
+}
+
+/// Gets a read-only view of a C-contiguous (num_samples, num_features) uint64 matrix.
+static bool GetSampleMatrix(PyObject* object, size_t numFeatures, Py_buffer& view, size_t& numSamples)
+{
+	if (PyObject_GetBuffer(object, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0)
+	{
+		return false;
+	}
+
+	if (view.itemsize != 8 || !IsUInt64Format(view.format))
+	{
+		PyErr_SetString(PyExc_TypeError, "samples must be an array of uint64");
+		PyBuffer_Release(&view);
+		return false;
+	}
+	if (view.ndim != 2 || (size_t)view.shape[1] != numFeatures)
+	{
+		PyErr_SetString(PyExc_ValueError, "samples must have shape (num_samples, len(feature_names))");
+		PyBuffer_Release(&view);
+		return false;
+	}
+
+	numSamples = (size_t)view.shape[0];
+	return true;
+}
+
+static bool CheckResult(int result)
+{
+	switch (result)
+	{
+	case IF_OK:
+		return true;
+	case IF_ERROR_OUT_OF_MEMORY:
+		PyErr_NoMemory();
+		return false;
+	case IF_ERROR_INVALID_ARGUMENT:
+		PyErr_SetString(PyExc_ValueError, "invalid argument");
+		return false;
+	default:
+		PyErr_SetString(PyExc_RuntimeError, "isolation forest engine error");
+		return false;
+	}
+}
+
+static int Forest_init(ForestObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* keywords[] = { "num_trees", "sub_sampling_size", NULL };
+	unsigned int numTrees = 10;
+	unsigned int subSamplingSize = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|II", (char**)keywords, &numTrees, &subSamplingSize))
+	{
+		return -1;
+	}
+
+	if (!self->lock)
+	{
+		self->lock = new (std::nothrow) EngineLock();
+		if (!self->lock)
+		{
+			PyErr_NoMemory();
+			return -1;
+		}
+	}
+
+	IF_Forest* forest = IF_CreateForest(numTrees, subSamplingSize);
+	if (!forest)
+	{
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	// __init__ may run again while another thread is inside the engine with the GIL
+	// released, so swap the forest under the lock and free the old one afterwards.
+	IF_Forest* oldForest;
+	Py_BEGIN_ALLOW_THREADS
+	self->lock->Lock();
+	oldForest = self->forest;
+	self->forest = forest;
+	self->lock->Unlock();
+	Py_END_ALLOW_THREADS
+
+	IF_DestroyForest(oldForest);
+	return 0;
+}
+
+static void Forest_dealloc(ForestObject* self)
+{
+	IF_DestroyForest(self->forest);
+	delete self->lock;
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static bool CheckInitialized(ForestObject* self)
+{
+	if (!self->forest || !self->lock)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "Forest is not initialized");
+		return false;
+	}
+	return true;
+}
+
+static PyObject* Forest_add_samples(ForestObject* self, PyObject* args)
+{
+	PyObject* namesObject;
+	PyObject* samplesObject;
+	if (!PyArg_ParseTuple(args, "OO", &namesObject, &samplesObject) || !CheckInitialized(self))
+	{
+		return NULL;
+	}
+
+	FeatureNames names;
+	Py_buffer view;
+	size_t numSamples = 0;
+	if (!GetFeatureNames(namesObject, names) || !GetSampleMatrix(samplesObject, names.pointers.size(), view, numSamples))
+	{
+		return NULL;
+	}
+
+	int result;
+	Py_BEGIN_ALLOW_THREADS
+	self->lock->Lock();
+	result = IF_AddSamples(self->forest, names.pointers.data(), names.pointers.size(), (const uint64_t*)view.buf, numSamples);
+	self->lock->Unlock();
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&view);
+	if (!CheckResult(result))
+	{
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* Forest_create(ForestObject* self, PyObject* Py_UNUSED(args))
+{
+	if (!CheckInitialized(self))
+	{
+		return NULL;
+	}
+
+	int result;
+	Py_BEGIN_ALLOW_THREADS
+	self->lock->Lock();
+	result = IF_Create(self->forest);
+	self->lock->Unlock();
+	Py_END_ALLOW_THREADS
+
+	if (!CheckResult(result))
+	{
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+/// Scores a matrix of samples. Results are written to `out` (a writable buffer of
+/// float64 with one element per sample) when given, otherwise to a new array.array('d').
+static PyObject* Forest_score(ForestObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* keywords[] = { "feature_names", "samples", "out", NULL };
+	PyObject* namesObject;
+	PyObject* samplesObject;
+	PyObject* outObject = Py_None;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|O", (char**)keywords, &namesObject, &samplesObject, &outObject) || !CheckInitialized(self))
+	{
+		return NULL;
+	}
+
+	FeatureNames names;
+	Py_buffer view;
+	size_t numSamples = 0;
+	if (!GetFeatureNames(namesObject, names) || !GetSampleMatrix(samplesObject, names.pointers.size(), view, numSamples))
+	{
+		return NULL;
+	}
+
+	if (outObject == Py_None)
+	{
+		PyObject* arrayModule = PyImport_ImportModule("array");
+		if (arrayModule)
+		{
+			PyObject* zeros = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)(numSamples * sizeof(double)));
+			if (zeros)
+			{
+				memset(PyBytes_AS_STRING(zeros), 0, numSamples * sizeof(double));
+				outObject = PyObject_CallMethod(arrayModule, "array", "sO", "d", zeros);
+				Py_DECREF(zeros);
+			}
+			else
+			{
+				outObject = NULL;
+			}
+			Py_DECREF(arrayModule);
+		}
+		else
+		{
+			outObject = NULL;
+		}
+		if (!outObject)
+		{
+			PyBuffer_Release(&view);
+			return NULL;
+		}
+	}
+	else
+	{
+		Py_INCREF(outObject);
+	}
+
+	Py_buffer outView;
+	if (PyObject_GetBuffer(outObject, &outView, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | PyBUF_WRITABLE) != 0)
+	{
+		PyBuffer_Release(&view);
+		Py_DECREF(outObject);
+		return NULL;
+	}
+	if (outView.itemsize != sizeof(double) || strcmp(outView.format ? outView.format : "", "d") != 0 || (size_t)(outView.len / outView.itemsize) != numSamples)
+	{
+		PyErr_SetString(PyExc_ValueError, "out must be a float64 buffer with one element per sample");
+		PyBuffer_Release(&outView);
+		PyBuffer_Release(&view);
+		Py_DECREF(outObject);
+		return NULL;
+	}
+
+	int result;
+	Py_BEGIN_ALLOW_THREADS
+	self->lock->LockShared();
+	result = IF_Score(self->forest, names.pointers.data(), names.pointers.size(), (const uint64_t*)view.buf, numSamples, (double*)outView.buf);
+	self->lock->UnlockShared();
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&outView);
+	PyBuffer_Release(&view);
+	if (!CheckResult(result))
+	{
+		Py_DECREF(outObject);
+		return NULL;
+	}
+	return outObject;
+}
+
+static PyObject* Forest_num_trees(ForestObject* self, PyObject* Py_UNUSED(args))
+{
+	if (!CheckInitialized(self))
+	{
+		return NULL;
+	}
+
+	size_t numTrees;
+	Py_BEGIN_ALLOW_THREADS
+	self->lock->LockShared();
+	numTrees = IF_NumTrees(self->forest);
+	self->lock->UnlockShared();
+	Py_END_ALLOW_THREADS
+
+	return PyLong_FromSize_t(numTrees);
+}
+
+static PyObject* Forest_memory_usage(ForestObject* self, PyObject* Py_UNUSED(args))
+{
+	if (!CheckInitialized(self))
+	{
+		return NULL;
+	}
+
+	size_t treeBytes = 0;
+	size_t trainingBytes = 0;
+	int result;
+	Py_BEGIN_ALLOW_THREADS
+	self->lock->LockShared();
+	result = IF_MemoryUsage(self->forest, &treeBytes, &trainingBytes);
+	self->lock->UnlockShared();
+	Py_END_ALLOW_THREADS
+
+	if (!CheckResult(result))
+	{
+		return NULL;
+	}
+	return Py_BuildValue("{s:n,s:n}", "tree_bytes", (Py_ssize_t)treeBytes, "training_bytes", (Py_ssize_t)trainingBytes);
+}
+
+static PyMethodDef Forest_methods[] =
+{
+	{ "add_samples", (PyCFunction)Forest_add_samples, METH_VARARGS, "add_samples(feature_names, samples): adds a (num_samples, num_features) uint64 matrix to the training set." },
+	{ "create", (PyCFunction)Forest_create, METH_NOARGS, "create(): builds the trees." },
+	{ "score", (PyCFunction)(void(*)(void))Forest_score, METH_VARARGS | METH_KEYWORDS, "score(feature_names, samples, out=None): scores a (num_samples, num_features) uint64 matrix." },
+	{ "num_trees", (PyCFunction)Forest_num_trees, METH_NOARGS, "num_trees(): number of trees in the forest." },
+	{ "memory_usage", (PyCFunction)Forest_memory_usage, METH_NOARGS, "memory_usage(): bytes used by the trees and by the training state." },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject ForestType =
+{
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"isolationforest_native.Forest", // tp_name
+	sizeof(ForestObject), // tp_basicsize
+};
+
+static PyModuleDef NativeModule =
+{
+	PyModuleDef_HEAD_INIT,
+	"isolationforest_native",
+	"Isolation Forest backed by the C++ engine.",
+	-1,
+	NULL
+};
+
+PyMODINIT_FUNC PyInit_isolationforest_native(void)
+{
+	ForestType.tp_dealloc = (destructor)Forest_dealloc;
+	ForestType.tp_flags = Py_TPFLAGS_DEFAULT;
+	ForestType.tp_doc = "Forest(num_trees=10, sub_sampling_size=0)";
+	ForestType.tp_methods = Forest_methods;
+	ForestType.tp_init = (initproc)Forest_init;
+	ForestType.tp_new = PyType_GenericNew;
+	if (PyType_Ready(&ForestType) < 0)
+	{
+		return NULL;
+	}
+
+	PyObject* module = PyModule_Create(&NativeModule);
+	if (!module)
+	{
+		return NULL;
+	}
+
+	Py_INCREF(&ForestType);
+	if (PyModule_AddObject(module, "Forest", (PyObject*)&ForestType) < 0)
+	{
+		Py_DECREF(&ForestType);
+		Py_DECREF(module);
+		return NULL;
+	}
+	return module;
+}
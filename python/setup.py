@@ -1,7 +1,15 @@
-from setuptools import setup, find_packages
+from setuptools import setup, find_packages, Extension
 
 requirements = ['plotly']
 
+# Native binding to the C++ engine. Built from the sources in the repository root.
+native = Extension(
+    'isolationforest_native',
+    sources=['isolationforest_native.cpp', '../IsolationForest.cpp', '../IsolationForestC.cpp'],
+    include_dirs=['..'],
+    language='c++',
+)
+
 setup(
     name='libisolationforest',
     version='0.1.0',
@@ -10,4 +18,5 @@ setup(
     author='Mike Simms',
     packages=find_packages(exclude=['contrib', 'docs', 'tests']),
     install_requires=requirements,
+    ext_modules=[native],
 )
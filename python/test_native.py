@@ -0,0 +1,126 @@
+#  MIT License
+#
+#  Copyright (c) 2018 Michael J Simms. All rights reserved.
+#
+#  Permission is hereby granted, free of charge, to any person obtaining a copy
+#  of this software and associated documentation files (the "Software"), to deal
+#  in the Software without restriction, including without limitation the rights
+#  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+#  copies of the Software, and to permit persons to whom the Software is
+#  furnished to do so, subject to the following conditions:
+#
+#  The above copyright notice and this permission notice shall be included in all
+#  copies or substantial portions of the Software.
+#
+#  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+#  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+#  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+#  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+#  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+#  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+#  SOFTWARE.
+
+# Checks the native binding: scoring a matrix in one call must give the same
+# scores as scoring it one row at a time, whether the scores are returned or
+# written to a caller supplied buffer. Build the extension first with
+# "python3 setup.py build_ext --inplace".
+
+import array
+import random
+import threading
+import time
+import isolationforest_native
+
+def matrix(rows, num_features):
+    """Returns a (len(rows), num_features) uint64 view over the flattened rows."""
+    values = array.array('Q', [value for row in rows for value in row])
+    return memoryview(values).cast('B').cast('Q', [len(rows), num_features])
+
+def check_batch_and_single_row_scores():
+    feature_names = ["x", "y", "z"]
+    training = [[random.randint(0, 25) for _ in feature_names] for _ in range(500)]
+    tests = [[random.randint(0, 45) for _ in feature_names] for _ in range(200)]
+
+    forest = isolationforest_native.Forest(50, 10)
+    forest.add_samples(feature_names, matrix(training, len(feature_names)))
+    forest.create()
+    assert forest.num_trees() == 50
+
+    batch_scores = forest.score(feature_names, matrix(tests, len(feature_names)))
+    out = array.array('d', [0.0] * len(tests))
+    forest.score(feature_names, matrix(tests, len(feature_names)), out=out)
+
+    for i, row in enumerate(tests):
+        single = forest.score(feature_names, matrix([row], len(feature_names)))
+        assert single[0] == batch_scores[i], "row %d: %r != %r" % (i, single[0], batch_scores[i])
+        assert out[i] == batch_scores[i], "row %d: out=%r != %r" % (i, out[i], batch_scores[i])
+
+    # Columns in a different order name the same features.
+    reordered_names = ["z", "x", "y"]
+    reordered = [[row[2], row[0], row[1]] for row in tests]
+    reordered_scores = forest.score(reordered_names, matrix(reordered, len(reordered_names)))
+    assert list(reordered_scores) == list(batch_scores)
+    print("Batch, single row and out= scores match for %d samples." % len(tests))
+
+def check_reinit_while_scoring():
+    """Re-running __init__ while other threads are in the engine must not crash."""
+    feature_names = ["x", "y"]
+    rows = [[random.randint(0, 25) for _ in feature_names] for _ in range(2000)]
+    forest = isolationforest_native.Forest(20, 10)
+    forest.add_samples(feature_names, matrix(rows, len(feature_names)))
+    forest.create()
+
+    stop = threading.Event()
+    def score_loop():
+        while not stop.is_set():
+            forest.score(feature_names, matrix(rows, len(feature_names)))
+            forest.memory_usage()
+
+    threads = [threading.Thread(target=score_loop) for _ in range(2)]
+    for thread in threads:
+        thread.start()
+    for _ in range(50):
+        forest.__init__(20, 10)
+        forest.add_samples(feature_names, matrix(rows, len(feature_names)))
+        forest.create()
+    stop.set()
+    for thread in threads:
+        thread.join()
+    print("Re-initialized the forest 50 times while scoring.")
+
+def check_concurrent_scoring():
+    """Scoring takes the engine lock shared: a quick call is not held up behind a long
+    scoring call in another thread, and concurrent calls give the serial scores."""
+    feature_names = ["x", "y"]
+    training = [[random.randint(0, 25) for _ in feature_names] for _ in range(2000)]
+    forest = isolationforest_native.Forest(100, 64)
+    forest.add_samples(feature_names, matrix(training, len(feature_names)))
+    forest.create()
+
+    tests = matrix([[random.randint(0, 45) for _ in feature_names] for _ in range(50000)], len(feature_names))
+    start = time.perf_counter()
+    expected = list(forest.score(feature_names, tests))
+    long_call = time.perf_counter() - start
+
+    results = []
+    long_thread = threading.Thread(target=lambda: results.append(list(forest.score(feature_names, tests))))
+    long_thread.start()
+    time.sleep(long_call / 10)
+    start = time.perf_counter()
+    small = forest.score(feature_names, matrix([[1, 2]], len(feature_names)))
+    quick_call = time.perf_counter() - start
+    still_running = long_thread.is_alive()
+    long_thread.join()
+
+    assert results[0] == expected
+    assert small[0] == forest.score(feature_names, matrix([[1, 2]], len(feature_names)))[0]
+    assert not still_running or quick_call < long_call / 2, "scoring calls were serialized (%.3fs vs %.3fs)" % (quick_call, long_call)
+    print("A quick scoring call took %.4fs during a %.3fs scoring call." % (quick_call, long_call))
+
+def main():
+    check_batch_and_single_row_scores()
+    check_reinit_while_scoring()
+    check_concurrent_scoring()
+
+if __name__ == "__main__":
+    main()